@@ -0,0 +1,94 @@
+#!/bin/bash
+# Seek benchmark of the block allocator.
+# The same workload runs on a disk formatted with one cylinder group
+#      (all the inodes in front of all the data blocks) and on a disk
+#      formatted with the default cylinder groups.
+# Then the total track-to-track time charged by disk.c is reported.
+# At last, the default cylinder groups run under each scheduling
+#      policy of disk.c, and the wall time of each storage backend
+#      (syncing every write) and of each transport between fs.c and
+#      disk.c is reported, including 1 s of startup.
+#
+# Usage: ./bench_seek.sh [cylinders] [sectors] [delay]
+# Build first with 'make'.
+
+CYL=${1:-64}
+SEC=${2:-128}
+DELAY=${3:-10}
+DIRS=8          # number of directories
+FILES=12        # number of files per directory
+ROUNDS=3        # number of appends per file
+
+# Output the workload of client.c.
+workload() {
+    local data
+    data=$(head -c 300 /dev/zero | tr '\0' 'a')
+    echo "f"
+    for d in $(seq $DIRS); do
+        echo "mkdir d$d"
+    done
+    for d in $(seq $DIRS); do
+        echo "cd /d$d"
+        for f in $(seq $FILES); do
+            echo "mk f$f"
+        done
+    done
+    # files grow at the same time, as in a busy system
+    for r in $(seq $ROUNDS); do
+        for d in $(seq $DIRS); do
+            echo "cd /d$d"
+            for f in $(seq $FILES); do
+                echo "i f$f 99999 300 $data"
+            done
+        done
+    done
+    for d in $(seq $DIRS); do
+        echo "cd /d$d"
+        for f in $(seq $FILES); do
+            echo "cat f$f"
+        done
+    done
+    echo "e"
+}
+
+# Run the workload with '-g $1', disk.c options "$2", fs.c options "$3",
+#      over TCP, or Unix-domain sockets if $4 is 'unix',
+#      and print the total track-to-track time.
+run() {
+    local img=bench_seek.img
+    local port=$((20000 + RANDOM % 20000))
+    local disk_addr=$port
+    local fs_addr=$((port + 1))
+    if [ "$4" = unix ]; then
+        disk_addr=unix:bench_disk.sock
+        fs_addr=unix:bench_fs.sock
+    fi
+    rm -f $img
+    ./disk $2 $CYL $SEC $DELAY $img $disk_addr > bench_seek.log &
+    local disk_pid=$!
+    sleep 0.5
+    ./fs -g $1 $3 $disk_addr $fs_addr > /dev/null &
+    sleep 0.5
+    workload | ./client $fs_addr > /dev/null
+    wait $disk_pid
+    grep "Total track-to-track time" bench_seek.log | awk '{print $4}'
+    rm -f $img bench_seek.log
+}
+
+before=$(run 1)
+after=$(run 0)
+echo "one cylinder group:     $before"
+echo "default cylinder groups: $after"
+for p in fcfs sstf scan clook; do
+    printf "%-24s%s\n" "policy $p:" "$(run 0 "-p $p")"
+done
+for b in mmap pread uring; do
+    start=$(date +%s%N)
+    run 0 "-b $b -s write" > /dev/null
+    printf "%-24s%s ms\n" "backend $b:" $(( ($(date +%s%N) - start) / 1000000 ))
+done
+for t in tcp unix ring; do
+    start=$(date +%s%N)
+    run 0 "" "$([ $t = ring ] && echo -r)" $t > /dev/null
+    printf "%-24s%s ms\n" "transport $t:" $(( ($(date +%s%N) - start) / 1000000 ))
+done
@@ -15,6 +15,7 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <time.h>
+#include "transport.h"
 
 #define MAX_INPUT 256   // the maximum input length
 #define MAX_OUTPUT 1024 // the maximum output length
@@ -22,33 +23,9 @@
 static int sockfd;      // socket with fs.c
 
 // Initialize client.
+// argv[1]: address of fs.c, see transport.h
 void init_client(char *argv[]) {
-    int portno;
-    struct sockaddr_in serv_addr;
-    struct hostent *server;
-    char host_name[20] = "localhost";
-
-    portno = atoi(argv[1]);
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        printf("Error: opening socket.\n");
-        exit(-1);
-    }
-    server = gethostbyname(host_name);
-    if (server == NULL) {
-        printf("Error: no such host.\n");
-        exit(-1);
-    }
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    bcopy((char *) server->h_addr,
-          (char *) &serv_addr.sin_addr.s_addr,
-          server->h_length);
-    serv_addr.sin_port = htons(portno);
-    if (connect(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-        printf("Error: connecting.\n");
-        exit(-1);
-    }
+    sockfd = transport_connect(argv[1]);
 }
 
 // Read the input from stdin.
@@ -114,7 +91,7 @@ void polling() {
 int main(int argc, char *argv[]) {
 
     if (argc < 2) {
-        printf("Error: no port provided.\n");
+        printf("Error: no address provided.\n");
         exit(-1);
     } else if (argc > 2) {
         printf("Error: Input error.\n");
@@ -15,60 +15,552 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <stdarg.h>
+#include "protocol.h"
+#include "storage.h"
+#include "ring.h"
+#include "transport.h"
+#include "trace.h"
 
 #define BLOCK_SIZE 256
-#define MAX_LEN 1024     // the maximum length of socket message
+#define MAX_LEN DISK_MAX_LEN     // the maximum length of payload
 
 // =================================================================
 // You can modify this part to get different output type.
 
-// If TELNET_TEST is 1, use telnet directly to test.
-#define TELNET_TEST 0
-
 // If SOCKET_OPEN is 1, use socket.
+// Otherwise, read text commands from stdin:
+//      "I", "R c s", "W c s data", "S c s ch" and "E".
 #define SOCKET_OPEN 1
+
+// Default scheduling policy of requests in queue and blocks of a request.
+// It can be changed at startup by '-p <fcfs|sstf|scan|clook>'.
+#define POLICY POLICY_FCFS
+
+// Default deadline: a request is served next once this many requests
+//      have been served after its arrival, whatever the policy.
+// It can be changed at startup by '-d <requests>'.
+#define DEADLINE 16
+
+// Default time for a sector to pass under the head, in the unit of
+//      track-to-track delay. A revolution takes SECTORS_PC times of it.
+// Before accessing a block, the head waits for its sector to come,
+//      then transfers the block in this time.
+// It can be changed at startup by '-t <time>', and 0 only charges seeks.
+#define SECTOR_TIME 1
+
+// Default durability of writes, changed at startup by '-s <mode>':
+//      none:  left to the OS, except 'F' and exit
+//      write: each write is synced to storage before its reply
+//      group: replies of writes are held, and sent after one sync when
+//             GROUP_WRITES writes are held or the oldest is GROUP_MS old
+// The group can be changed by '-n <writes>' and '-i <ms>'.
+#define SYNC_MODE SYNC_NONE
+#define GROUP_WRITES 16
+#define GROUP_MS 5
+
+// Default backend of storage file, changed at startup by '-b <name>'.
+// See storage.h.
+#define BACKEND "mmap"
+
+// Default verbosity of the text of requests on stdout and in disk.log,
+//      changed at startup by '-v <level>':
+//      0: none, only connections, errors and the totals at exit
+//      1: each request and its result
+//      2: also the data of blocks read, as always in text mode
+// Below 2, the blocks go to the socket without a copy if the backend
+//      maps them (see storage.h).
+#define VERBOSE 1
+
+// Default binary trace file of requests, none if NULL (see trace.h).
+// It can be set at startup by '-T <file>', and read by trace_dump.
+#define TRACE_FILE NULL
 // =================================================================
 
-static int FILE_SIZE;
+// Durability mode.
+#define SYNC_NONE 0
+#define SYNC_WRITE 1
+#define SYNC_GROUP 2
+static char *sync_name[] = {"none", "write", "group"};
+
+// Scheduling policy.
+#define POLICY_FCFS 0       // first come, first served
+#define POLICY_SSTF 1       // shortest seek time first
+#define POLICY_SCAN 2       // sweep to the end of disk, then turn back
+#define POLICY_CLOOK 3      // sweep up to the last request, then jump to the lowest
+static char *policy_name[] = {"fcfs", "sstf", "scan", "clook"};
+
+// queue_entry
+// A request waiting to be served.
+#define QUEUE_SIZE 64
+struct queue_entry {
+    struct disk_request request;
+    char *payload;
+    int age;                // requests served after its arrival
+    __u32 first;            // the lowest LBA
+    __u32 last;             // the highest LBA, first > last if no block
+    int conn;               // connection to reply, -1 for stdin
+    long arrival;           // virtual clock at arrival
+    __u64 arrival_time;     // time of arrival for trace
+};
+
+// connection
+// A client (fs.c or a tool) of disk.c.
+// Requests are read and replies are sent without blocking, so one slow
+//      client never stops the others.
+#define MAX_CONN 16
+#define CONN_QUEUE 16       // the most requests of a connection in queue
+struct connection {
+    int fd;                 // socket, -1 if closed
+    char *in;               // the request being read
+    int in_len;             // Bytes of the request read so far
+    char *out;              // replies not sent yet
+    int out_len;
+    int out_size;
+    int queued;             // requests in queue
+    int closing;            // 1 after 'E': closed once replies are sent
+    int held;               // replies held for group commit
+    struct disk_stat stat;  // statistics of its requests
+    struct ring_shm *ring;  // shared-memory ring, NULL if messages go through socket
+};
+
+static long FILE_SIZE;
 static int CYLINDERS;
 static int SECTORS_PC;
 static int MOVE_DELAY;
 static int cur_cylinder;    // current access cylinder
+static int direction = 1;   // direction of head, 1: up, -1: down
+static int sector_time = SECTOR_TIME;
+static long vclock;         // virtual clock: simulated time of served requests
+static struct disk_stat cost;       // cost of the current request so far
+static struct disk_stat stat_all;   // statistics of all requests
+static long cur_arrival;    // virtual clock at arrival of the current request
+static __u64 cur_arrival_time;  // time of arrival of the current request for trace
+static int verbose = VERBOSE;
+static char *trace_name = TRACE_FILE;
+static int sync_mode = SYNC_MODE;
+static int group_writes = GROUP_WRITES;
+static int group_ms = GROUP_MS;
+static int unsynced;        // 1 if storage file is written after the last sync
+static int sync_count;      // syncs to storage
+static int policy = POLICY; // scheduling policy
+static int deadline = DEADLINE;
+static long total_time;     // total track-to-track time
 static char *file_name;     // storage file name
-static int fd;              // file id of storage file name
+static struct storage *store;   // backend of storage file
 static FILE *disk_log;      // file id of disk.log
-static char *disk_file;     // pointer of memory map
-
-static int sockfd;          // socket with fs.c
-static int newsockfd;       // new socket with fs.c
-static socklen_t clilen;
-struct sockaddr_in serv_addr;
-struct sockaddr_in cli_addr;
-static char buffer[MAX_LEN];// I/O buffer
-
-// Write the input to client.
-void server_write(char buffer[MAX_LEN], int length) {
-    int n = write(newsockfd, buffer, length);
-    if (n < 0) {
-        printf("Error: writing to socket.\n");
-        exit(-1);
+
+static int sockfd;          // listening socket
+static int epollfd;         // epoll of listening socket and connections
+static struct disk_request request;     // current request
+static char payload[MAX_LEN];           // payload of current request
+static int cur_conn;                    // connection of current request
+static char reply_data[DISK_MAX_COUNT * BLOCK_SIZE];    // payload of reply
+static struct queue_entry queue[QUEUE_SIZE];    // requests in order of arrival
+static int queue_num;                           // number of requests in queue
+static int stdin_closed;                        // 1 if stdin is closed
+static struct connection conn[MAX_CONN];        // clients
+static int conn_num;                            // number of open connections
+static int conn_accepted;                       // connections ever accepted
+
+// held_reply
+// A reply of write waiting for the sync of its group.
+struct held_reply {
+    int conn;
+    struct disk_reply reply;
+};
+static struct held_reply *held;                 // replies held for group commit
+static int held_num;
+static int held_size;
+static long held_time;                          // time of the oldest held reply (ms)
+
+// Print the text of the current request to stdout, if verbose.
+void print_out(const char *format, ...) {
+    if (verbose < 1)
+        return;
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+// Print the result of the current request to disk.log, if verbose.
+void print_log(const char *format, ...) {
+    if (verbose < 1)
+        return;
+    va_list args;
+    va_start(args, format);
+    vfprintf(disk_log, format, args);
+    va_end(args);
+}
+
+// Add statistics 'b' to 'a'.
+void stat_add(struct disk_stat *a, struct disk_stat *b) {
+    // all the fields are __u64
+    __u64 *x = (__u64 *) a;
+    __u64 *y = (__u64 *) b;
+    for (int i = 0; i < (int) (sizeof(struct disk_stat) / sizeof(__u64)); i++)
+        x[i] += y[i];
+}
+
+// Print statistics 's' of 'name'.
+void print_stat(const char *name, struct disk_stat *s) {
+    printf("%s: simulated time %llu (seek %llu, rotation %llu, transfer %llu), "
+           "%llu seeks over %llu cylinders\n", name,
+           (unsigned long long) s->time, (unsigned long long) s->seek_time,
+           (unsigned long long) s->rotation_time, (unsigned long long) s->transfer_time,
+           (unsigned long long) s->seeks, (unsigned long long) s->cylinders);
+    printf("    requests:");
+    for (int i = 0; i < DISK_STAT_OP_NUM; i++)
+        printf(" %c %llu", DISK_STAT_OPS[i], (unsigned long long) s->ops[i]);
+    printf("\n    latency:");
+    for (int i = 0; i < DISK_STAT_HIST; i++) {
+        if (s->latency[i] == 0)
+            continue;
+        if (i <= 1)
+            printf(" %d: %llu", i, (unsigned long long) s->latency[i]);
+        else if (i == DISK_STAT_HIST - 1)
+            printf(" %ld+: %llu", 1L << (i - 1), (unsigned long long) s->latency[i]);
+        else
+            printf(" %ld~%ld: %llu", 1L << (i - 1), (1L << i) - 1, (unsigned long long) s->latency[i]);
     }
+    printf("\n");
 }
 
-// Read the output from client.
-void server_read(char buffer[MAX_LEN]) {
-    bzero(buffer, MAX_LEN);
-    int n = read(newsockfd, buffer, MAX_LEN);
-    if (n < 0) {
-        printf("Error: reading from socket.\n");
-        exit(-1);
+// Drop connection k.
+// Its slot is reused only after its queued requests are served.
+void conn_close(int k) {
+    struct connection *c = &conn[k];
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->in_len = 0;
+    c->out_len = 0;
+    c->closing = 0;
+    if (c->ring != NULL) {
+        ring_detach(c->ring);
+        c->ring = NULL;
     }
-    printf("read: %s\n", buffer);
+    conn_num--;
+    printf("Connection %d closed.\n", k);
+    print_stat("connection", &c->stat);
+}
+
+// Watch connection k for input, unless it is closing,
+//      and for output if a reply is left to send.
+void conn_watch(int k) {
+    struct connection *c = &conn[k];
+    struct epoll_event ev;
+    ev.events = (c->closing ? 0 : EPOLLIN) | (c->out_len > 0 ? EPOLLOUT : 0);
+    ev.data.u32 = k;
+    epoll_ctl(epollfd, EPOLL_CTL_MOD, c->fd, &ev);
 }
 
-// print the
+// Send as much of the reply buffer of connection k as the socket takes.
+// A connection closing after 'E' is dropped once everything is sent.
+void conn_flush(int k) {
+    struct connection *c = &conn[k];
+    int sent = 0;
+    while (sent < c->out_len) {
+        int n = send(c->fd, c->out + sent, c->out_len - sent, MSG_NOSIGNAL);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0) {       // peer is gone, the rest can not be sent
+            conn_close(k);
+            return;
+        }
+        sent += n;
+    }
+    memmove(c->out, c->out + sent, c->out_len - sent);
+    c->out_len -= sent;
+    if (c->out_len == 0 && c->closing)
+        conn_close(k);
+    else
+        conn_watch(k);
+}
+
+// Send the n pieces of 'iov' to connection k.
+// A connection with a ring gets them in a slot of its completion ring.
+// If nothing is waiting in the reply buffer, they go to the socket in one
+//      call without a copy, and only what it does not take is appended
+//      to the reply buffer, to be sent when it is writable.
+void conn_sendv(int k, struct iovec *iov, int n) {
+    struct connection *c = &conn[k];
+    if (c->fd < 0)          // closed before its requests are served
+        return;
+    if (c->ring != NULL) {
+        // the client has a slot for each request in flight
+        struct ring_slot *slot = ring_next(&c->ring->cq);
+        if (slot == NULL) {
+            printf("Error: ring of connection %d is full.\n", k);
+            conn_close(k);
+            return;
+        }
+        slot->length = 0;
+        for (int i = 0; i < n; i++) {
+            memcpy(slot->data + slot->length, iov[i].iov_base, iov[i].iov_len);
+            slot->length += iov[i].iov_len;
+        }
+        if (ring_push(&c->ring->cq))
+            ring_wake(&c->ring->cq);
+        if (c->closing)
+            conn_close(k);
+        return;
+    }
+    long sent = 0;
+    if (c->out_len == 0) {
+        struct msghdr msg;
+        bzero(&msg, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+        sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            conn_close(k);  // peer is gone, the rest can not be sent
+            return;
+        }
+        if (sent < 0)
+            sent = 0;
+    }
+    for (int i = 0; i < n; i++) {
+        long skip = sent < (long) iov[i].iov_len ? sent : (long) iov[i].iov_len;
+        long length = iov[i].iov_len - skip;
+        sent -= skip;
+        if (length == 0)
+            continue;
+        if (c->out_len + length > c->out_size) {
+            c->out_size = (c->out_len + length) * 2;
+            c->out = (char *) realloc(c->out, c->out_size);
+            if (c->out == NULL) {
+                printf("Error: Could not allocate reply buffer.\n");
+                exit(-1);
+            }
+        }
+        memcpy(c->out + c->out_len, (char *) iov[i].iov_base + skip, length);
+        c->out_len += length;
+    }
+    conn_flush(k);
+}
+
+// Send 'length' Bytes of 'data' to connection k.
+void conn_send(int k, const char *data, int length) {
+    struct iovec iov = {(void *) data, length};
+    conn_sendv(k, &iov, 1);
+}
+
+// Accept new connections from fs.c and tools.
+void conn_accept() {
+    while (1) {
+        int newsockfd = transport_accept(sockfd);
+        if (newsockfd < 0)
+            return;
+
+        int k = 0;
+        while (k < MAX_CONN && (conn[k].fd >= 0 || conn[k].queued > 0 || conn[k].held > 0))
+            k++;
+        if (k == MAX_CONN) {
+            printf("Error: too many connections.\n");
+            close(newsockfd);
+            continue;
+        }
+        fcntl(newsockfd, F_SETFL, O_NONBLOCK);
+        conn[k].fd = newsockfd;
+        conn[k].in_len = 0;
+        conn[k].out_len = 0;
+        conn[k].closing = 0;
+        conn[k].ring = NULL;
+        bzero(&conn[k].stat, sizeof(conn[k].stat));
+        conn_num++;
+        conn_accepted++;
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.u32 = k;
+        if (epoll_ctl(epollfd, EPOLL_CTL_ADD, newsockfd, &ev) < 0) {
+            printf("Error: on epoll_ctl.\n");
+            exit(-1);
+        }
+        printf("Connection %d opened.\n", k);
+    }
+}
+
+// Return: the LBA of the i-th block of request 'req' with 'data' as payload.
+// The LBAs of 'r' and 'w' are listed at the front of payload.
+__u32 __request_lba(struct disk_request *req, char *data, int i) {
+    __u32 lba;
+    if (req->op == DISK_OP_READV || req->op == DISK_OP_WRITEV) {
+        memcpy(&lba, data + i * 4, 4);
+        return lba;
+    }
+    return req->lba + i;
+}
+
+// Return: the LBA of the i-th block of the current request.
+__u32 request_lba(int i) {
+    return __request_lba(&request, payload, i);
+}
+
+// Finish the cost of the current request, advance virtual clock, add
+//      the request to statistics of disk and of its connection, and
+//      trace it with 'status' of its reply.
+// Return: simulated time of the request.
+int account_request(int status) {
+    cost.time = cost.seek_time + cost.rotation_time + cost.transfer_time;
+    vclock += cost.time;
+
+    long latency = vclock - cur_arrival;
+    int h = 0;
+    while (h < DISK_STAT_HIST - 1 && latency >= (1L << h))
+        h++;
+    cost.latency[h] = 1;
+    char *op = request.op ? strchr(DISK_STAT_OPS, request.op) : NULL;
+    if (op != NULL)
+        cost.ops[op - DISK_STAT_OPS] = 1;
+
+    stat_add(&stat_all, &cost);
+    if (cur_conn >= 0)
+        stat_add(&conn[cur_conn].stat, &cost);
+
+    struct trace_record r;
+    bzero(&r, sizeof(r));
+    r.arrival = cur_arrival_time;
+    r.time = trace_now();
+    r.op = request.op;
+    r.status = status;
+    r.conn = cur_conn;
+    r.id = request.id;
+    r.count = request.count;
+    r.cylinders = cost.cylinders;
+    r.sim_time = cost.time;
+    r.latency = latency;
+    struct trace_lbas lbas[(DISK_MAX_COUNT + TRACE_LBAS - 2) / TRACE_LBAS];
+    int vector = request.op == DISK_OP_READV || request.op == DISK_OP_WRITEV;
+    if (request.count > 0 && request.count <= DISK_MAX_COUNT &&
+            !(vector && request.length < request.count * 4)) {
+        r.lba = request_lba(0);
+        if (vector) {
+            r.lbas = (request.count + TRACE_LBAS - 2) / TRACE_LBAS;
+            bzero(lbas, r.lbas * sizeof(struct trace_lbas));
+            for (int i = 1; i < request.count; i++)
+                lbas[(i - 1) / TRACE_LBAS].lba[(i - 1) % TRACE_LBAS] = request_lba(i);
+        }
+    }
+    trace_add(&r, lbas);
+
+    int time = cost.time;
+    bzero(&cost, sizeof(cost));
+    return time;
+}
+
+// Return: 1 if request 'req' writes disk.
+int is_write(struct disk_request *req) {
+    return req->op == DISK_OP_WRITE || req->op == DISK_OP_WRITEV || req->op == DISK_OP_SET;
+}
+
+// Return: monotonic time in us.
+long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+// Return: monotonic time in ms.
+long now_ms() {
+    return now_us() / 1000;
+}
+
+// Write the dirty part of storage file to storage, then send the write
+//      replies held for it.
+void sync_file() {
+    if (unsynced) {
+        store->sync();
+        unsynced = 0;
+        sync_count++;
+    }
+    for (int i = 0; i < held_num; i++) {
+        conn[held[i].conn].held--;
+        conn_send(held[i].conn, (char *) &held[i].reply, sizeof(held[i].reply));
+    }
+    held_num = 0;
+}
+
+// Hold the reply of a write until the next sync, for group commit.
+// The group is synced when it has 'group_writes' writes.
+void hold_reply(struct disk_reply *reply) {
+    if (held_num == held_size) {
+        held_size = held_size * 2 + 16;
+        held = (struct held_reply *) realloc(held, held_size * sizeof(struct held_reply));
+        if (held == NULL) {
+            printf("Error: Could not allocate held replies.\n");
+            exit(-1);
+        }
+    }
+    if (held_num == 0)
+        held_time = now_ms();
+    held[held_num].conn = cur_conn;
+    held[held_num].reply = *reply;
+    held_num++;
+    conn[cur_conn].held++;
+    if (held_num >= group_writes)
+        sync_file();
+}
+
+// Return: ms to wait before the held replies must be synced,
+//      or -1 if no reply is held.
+int sync_timeout() {
+    if (held_num == 0)
+        return -1;
+    long left = held_time + group_ms - now_ms();
+    return left > 0 ? left : 0;
+}
+
+// Reply to the current request with the n pieces of 'data' as payload.
+// Every request is replied once, and is accounted here.
+// A write is replied after it is on storage if durability mode asks.
+void send_reply_v(int status, struct iovec *data, int n) {
+    int length = 0;
+    for (int i = 0; i < n; i++)
+        length += data[i].iov_len;
+    int time = account_request(status);
+    if (!SOCKET_OPEN)
+        return;
+    struct disk_reply reply;
+    bzero(&reply, sizeof(reply));
+    reply.op = request.op;
+    reply.status = status;
+    reply.id = request.id;
+    reply.length = length;
+    reply.time = time;
+    if (is_write(&request) && status == DISK_OK) {
+        if (sync_mode == SYNC_WRITE)
+            sync_file();
+        if (sync_mode == SYNC_GROUP) {
+            hold_reply(&reply);
+            return;
+        }
+    }
+    struct iovec iov[DISK_MAX_COUNT + 1];
+    iov[0].iov_base = &reply;
+    iov[0].iov_len = sizeof(reply);
+    memcpy(iov + 1, data, n * sizeof(struct iovec));
+    conn_sendv(cur_conn, iov, n + 1);
+}
+
+// Reply to the current request with 'length' Bytes of 'data'.
+void send_reply(int status, const char *data, int length) {
+    struct iovec iov = {(void *) data, length};
+    send_reply_v(status, &iov, length > 0);
+}
+
+// Print the track-to-track time, rotational delay and transfer time
+//      of the current request.
 void print_time(int time) {
-    printf("track-to-track time: %d\n", time);
+    total_time += time;
+    print_out("track-to-track time: %d\n", time);
+    print_out("rotational delay: %llu, transfer time: %llu\n",
+           (unsigned long long) cost.rotation_time, (unsigned long long) cost.transfer_time);
 }
 
 void input_detect(int argc) {
@@ -88,345 +580,822 @@ void input_detect(int argc) {
     }
 }
 
-void check_file() {
-    int result = write(fd, "", 1);
-    if (result != 1) {
-        perror("Error writing last byte of the file");
-        close(fd);
-        exit(-1);
-    }
-}
-
 void storage_init(char *argv[]) {
     // get parameters
     CYLINDERS = atoi(argv[1]);
     SECTORS_PC = atoi(argv[2]);
     MOVE_DELAY = atoi(argv[3]);
     file_name = argv[4];
-    FILE_SIZE = CYLINDERS * SECTORS_PC * BLOCK_SIZE;
+    FILE_SIZE = (long) CYLINDERS * SECTORS_PC * BLOCK_SIZE;
 
-    // open storage file
-    fd = open(file_name, O_RDWR | O_CREAT, S_IRWXU);
+    // create storage file
+    int fd = open(file_name, O_RDWR | O_CREAT, S_IRWXU);
     if (fd < 0) {
         printf("Error: Could not open file '%s'.\n", file_name);
         exit(-1);
     }
 
-    // check the size of file
-    int result = lseek(fd, FILE_SIZE - 1, SEEK_SET);
-    if (result == -1) {
-        perror("Error calling lseek() to 'stretch' the file");
+    // size the file once, the blocks never written stay sparse
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (st.st_size < FILE_SIZE && ftruncate(fd, FILE_SIZE) < 0)) {
         close(fd);
+        printf("Error: Could not size file '%s'.\n", file_name);
         exit(-1);
     }
+    close(fd);
 
-    // memory map
-    disk_file = (char *) mmap(NULL, FILE_SIZE,
-                              PROT_READ | PROT_WRITE,
-                              MAP_SHARED, fd, 0);
-    if (disk_file == MAP_FAILED) {
-        close(fd);
-        printf("Error: Could not map file.\n");
-        exit(-1);
-    }
+    store->open(file_name, FILE_SIZE);
 
     // open disk.log
     disk_log = fopen("disk.log", "w");
     if (disk_log == NULL) {
-        close(fd);
+        store->close();
         printf("Error: Could not open file 'disk.log'.\n");
         exit(-1);
     }
 }
 
+// Open the binary trace of requests.
+void trace_init() {
+    struct trace_header h;
+    bzero(&h, sizeof(h));
+    h.magic = TRACE_MAGIC;
+    h.version = TRACE_VERSION;
+    h.cylinders = CYLINDERS;
+    h.sectors_pc = SECTORS_PC;
+    h.move_delay = MOVE_DELAY;
+    h.sector_time = sector_time;
+    h.policy = policy;
+    trace_open(trace_name, &h);
+}
+
 // Initialize server.
 void init_server(char *argv[]) {
-    // server
-    int portno;
-
-    // create socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (sockfd < 0) {
-        printf("Error: opening socket.\n");
+    // server, argv[5]: address, see transport.h
+    sockfd = transport_listen(argv[5]);
+    fcntl(sockfd, F_SETFL, O_NONBLOCK);
+
+    // epoll: data.u32 is the connection, or MAX_CONN for listening socket
+    epollfd = epoll_create1(0);
+    if (epollfd < 0) {
+        printf("Error: on epoll_create.\n");
         exit(-1);
     }
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    portno = atoi(argv[5]);
-    serv_addr.sin_family = AF_INET;            // IPv4 address
-    serv_addr.sin_addr.s_addr = INADDR_ANY;    // bind the socket
-    serv_addr.sin_port = htons(portno);
-    // htons() converts the port number from host byte order to network byte order
-
-    // bind
-    if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-        printf("Error: on binding.\n");
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = MAX_CONN;
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, sockfd, &ev) < 0) {
+        printf("Error: on epoll_ctl.\n");
         exit(-1);
     }
-
-    // listen
-    if (listen(sockfd, 5) == -1) {
-        printf("Error: on listening.\n");
-        close(sockfd);
-        exit(-1);
+    for (int k = 0; k < MAX_CONN; k++) {
+        conn[k].fd = -1;
+        conn[k].in = (char *) malloc(sizeof(struct disk_request) + MAX_LEN);
+        if (conn[k].in == NULL) {
+            printf("Error: Could not allocate connection.\n");
+            exit(-1);
+        }
     }
-    clilen = sizeof(cli_addr);
     printf("Accepting connections ...\n");
+}
 
-    // wait for accept
-    newsockfd = accept(sockfd, (struct sockaddr *) &cli_addr, &clilen);
-    if (newsockfd < 0) {
-        printf("Error: on accept.\n");
-        exit(-1);
+// Read a text command from stdin to 'request' and 'payload'.
+// If stdin is closed, return 0.
+// Otherwise, return 1.
+int read_request_text() {
+    char line[MAX_LEN];
+    int c = 0, s = 0, n = 0;
+    if (fgets(line, MAX_LEN, stdin) == NULL)
+        return 0;
+    line[strcspn(line, "\n")] = '\0';
+
+    bzero(&request, sizeof(request));
+    request.op = line[0];
+    request.count = 1;
+    if (line[0] != '\0')
+        sscanf(line + 1, "%d %d %n", &c, &s, &n);
+    if (c < 0 || c >= CYLINDERS || s < 0 || s >= SECTORS_PC)
+        request.lba = CYLINDERS * SECTORS_PC;   // out of disk
+    else
+        request.lba = c * SECTORS_PC + s;
+
+    bzero(payload, MAX_LEN);
+    if (request.op == DISK_OP_WRITE && n > 0) {
+        strncpy(payload, line + 1 + n, BLOCK_SIZE);
+        request.length = BLOCK_SIZE;
+    } else if (request.op == DISK_OP_SET && n > 0) {
+        payload[0] = atoi(line + 1 + n);
+        request.length = 1;
     }
+    return 1;
 }
 
-// read c and s from buffer.
-void read_c_s(int *c, int *s) {
-    int i = 0, j = 0;
-    char c_str[64], s_str[64];
-    while (buffer[i + 2] != ' ') {
-        c_str[i] = buffer[i + 2];       // before the first ' ' is c
-        i++;
+// Check the current request accesses 1 ~ DISK_MAX_COUNT blocks in disk,
+//      with 'length' Bytes of payload.
+// If not, reply an error and return 0.
+int check_request(long length, char *name) {
+    if (request.count < 1 || request.count > DISK_MAX_COUNT || request.length != length) {
+        print_out("=================== output ====================\n");
+        print_log("No\n");
+        print_out("%s: Request error.\n", name);
+        send_reply(DISK_ERR_REQUEST, NULL, 0);
+        return 0;
+    }
+    for (int i = 0; i < request.count; i++) {
+        if (request_lba(i) >= (__u32) (CYLINDERS * SECTORS_PC)) {
+            print_out("=================== output ====================\n");
+            print_log("No\n");
+            print_out("%s: Location exceed.\n", name);
+            send_reply(DISK_ERR_RANGE, NULL, 0);
+            return 0;
+        }
     }
-    c_str[i] = '\0';
-    while (buffer[j + i + 3] != ' ' && buffer[j + i + 3] != '\0') {
-        s_str[j] = buffer[j + i + 3];   // before the second ' ' or '\0' is s
-        j++;
-    };
-    s_str[j] = '\0';
-    *c = atoi(c_str);
-    *s = atoi(s_str);
+    return 1;
+}
 
-    // truncate buffer
-    memcpy(buffer, buffer + i + j + 3, BLOCK_SIZE + 1);
+// Move the head to cylinder c, and charge track-to-track time.
+void move_head(int c) {
+    if (c == cur_cylinder)
+        return;
+    cost.seek_time += MOVE_DELAY * (abs(c - cur_cylinder));
+    cost.seeks++;
+    cost.cylinders += abs(c - cur_cylinder);
+    direction = c > cur_cylinder ? 1 : -1;
+    cur_cylinder = c;
+}
 
-    //printf("c: %d, s: %d, len: %d\n", *c, *s, (int) strlen(buffer));
+// Choose the next of n candidates by scheduling policy.
+// Candidate i is at cylinder 'cyl[i]', and cyl[i] < 0 means no candidate.
+// If 'sweep' is 1, SCAN moves the head to the end of disk before turning
+//      back. Otherwise, it turns back at the last candidate as LOOK does:
+//      for the blocks of one request, and for a single request in queue,
+//      the head has no reason to go further.
+// Return: index of the chosen candidate.
+int pick_next(int cyl[], int n, int sweep) {
+    int best = -1;
+    switch (policy) {
+        case POLICY_FCFS:
+            for (int i = 0; i < n && best < 0; i++)
+                if (cyl[i] >= 0)
+                    best = i;
+            break;
+        case POLICY_SSTF:
+            for (int i = 0; i < n; i++)
+                if (cyl[i] >= 0 && (best < 0 ||
+                        abs(cyl[i] - cur_cylinder) < abs(cyl[best] - cur_cylinder)))
+                    best = i;
+            break;
+        case POLICY_SCAN:
+            for (int turn = 0; turn < 2 && best < 0; turn++) {
+                for (int i = 0; i < n; i++)
+                    if (cyl[i] >= 0 && (cyl[i] - cur_cylinder) * direction >= 0 &&
+                            (best < 0 || abs(cyl[i] - cur_cylinder) < abs(cyl[best] - cur_cylinder)))
+                        best = i;
+                if (best < 0) {     // nothing ahead: turn back, at the end if sweeping
+                    if (sweep)
+                        move_head(direction > 0 ? CYLINDERS - 1 : 0);
+                    direction = -direction;
+                }
+            }
+            break;
+        case POLICY_CLOOK:
+            // the nearest one ahead, or the lowest one to start a new sweep
+            for (int i = 0; i < n; i++)
+                if (cyl[i] >= cur_cylinder && (best < 0 || cyl[i] < cyl[best]))
+                    best = i;
+            for (int i = 0; i < n && best < 0; i++)
+                if (cyl[i] >= 0)
+                    best = i;
+            for (int i = 0; i < n; i++)
+                if (cyl[i] >= 0 && cyl[best] < cur_cylinder && cyl[i] < cyl[best])
+                    best = i;
+            break;
+    }
+    return best;
 }
 
-// read c, s and buf from buffer.
-void read_c_s_buf(int *c, int *s, char buf[BLOCK_SIZE + 1]) {
-    read_c_s(c, s);
-    memcpy(buffer, buffer + 1, BLOCK_SIZE);
-    memcpy(buf, buffer, BLOCK_SIZE);
+// Wait for the sector of block 'lba' to come under the head, and
+//      transfer it. The head is on its cylinder.
+// The sector under the head at virtual time t is t / sector_time.
+void transfer_block(__u32 lba) {
+    if (sector_time == 0)
+        return;
+    long now = vclock + cost.seek_time + cost.rotation_time + cost.transfer_time;
+    int pos = now / sector_time % SECTORS_PC;
+    int sector = lba % SECTORS_PC;
+    cost.rotation_time += (long) (sector - pos + SECTORS_PC) % SECTORS_PC * sector_time;
+    cost.transfer_time += sector_time;
 }
 
-// Show cylinders and sectors per cylinder.
-int show_org() {
-    if (strlen(buffer) == 1) {
-        printf("=================== output ====================\n");
-        fprintf(disk_log, "%d %d\n", CYLINDERS, SECTORS_PC);
-        printf("%d %d\n", CYLINDERS, SECTORS_PC);
+// Move the head over the blocks of the current request, in the order
+//      of scheduling policy, and transfer them.
+// Return: track-to-track time of the request, including the moves made
+//      to choose it from queue.
+int seek_request() {
+    int cyl[DISK_MAX_COUNT];
+    for (int i = 0; i < request.count; i++)
+        cyl[i] = request_lba(i) / SECTORS_PC;
+    for (int k = 0; k < request.count; k++) {
+        int i = pick_next(cyl, request.count, 0);
+        move_head(cyl[i]);
+        transfer_block(request_lba(i));
+        cyl[i] = -1;
+    }
+    return cost.seek_time;
+}
+
+// Add request 'req' with 'data' as payload to the end of queue.
+// Its reply goes to connection k, or nowhere if k is -1.
+void queue_add(int k, struct disk_request *req, char *data) {
+    struct queue_entry *q = &queue[queue_num++];
+    q->request = *req;
+    q->payload = (char *) malloc(req->length + 1);
+    if (q->payload == NULL) {
+        printf("Error: Could not allocate queue.\n");
+        exit(-1);
+    }
+    memcpy(q->payload, data, req->length);
+    q->age = 0;
+    q->conn = k;
+    q->arrival = vclock;
+    q->arrival_time = trace_now();
+    if (k >= 0)
+        conn[k].queued++;
+
+    // LBA range, empty if the request has no block or is malformed
+    q->first = 1;
+    q->last = 0;
+    int vector = req->op == DISK_OP_READV || req->op == DISK_OP_WRITEV;
+    if (!(is_write(req) || req->op == DISK_OP_READ || req->op == DISK_OP_READV) ||
+            req->count < 1 || req->count > DISK_MAX_COUNT ||
+            (vector && req->length < req->count * 4))
+        return;
+    q->first = q->last = __request_lba(req, data, 0);
+    for (int i = 1; i < req->count; i++) {
+        __u32 lba = __request_lba(req, data, i);
+        if (lba < q->first)
+            q->first = lba;
+        if (lba > q->last)
+            q->last = lba;
+    }
+}
+
+// Map the ring named by request 'req' with 'data' of connection k,
+//      and reply through the socket. ('M')
+// It is served at once, not queued: the client sends it with no other
+//      request in flight.
+void conn_ring(int k, struct disk_request *req, char *data) {
+    struct connection *c = &conn[k];
+    struct ring_shm *shm = NULL;
+    if (req->length > 0 && data[req->length - 1] == '\0')
+        shm = ring_attach(data);
+
+    struct disk_reply reply;
+    bzero(&reply, sizeof(reply));
+    reply.op = req->op;
+    reply.status = shm != NULL ? DISK_OK : DISK_ERR_REQUEST;
+    reply.id = req->id;
+    conn_send(k, (char *) &reply, sizeof(reply));
+    if (shm != NULL && c->fd < 0)
+        ring_detach(shm);
+    else if (shm != NULL) {
+        c->ring = shm;
+        print_out("Connection %d uses ring '%s'.\n", k, data);
     } else {
-        return -1;
+        printf("Error: connection %d asked for a wrong ring.\n", k);
     }
+}
 
-    if (SOCKET_OPEN) {
-        char cylinders[8], sectors_pc[8], buf[32];
-        sprintf(cylinders, "%d ", CYLINDERS);
-        sprintf(sectors_pc, "%d", SECTORS_PC);
-        strcat(buf, cylinders);
-        strcat(buf, sectors_pc);
-        server_write(buf, strlen(buf));
+// Read requests of connection k from its submission ring to queue,
+//      until the ring is empty, or it has CONN_QUEUE requests in queue,
+//      or queue is full.
+void conn_ring_input(int k) {
+    struct connection *c = &conn[k];
+    struct ring_slot *slot;
+    while (c->fd >= 0 && !c->closing && c->queued < CONN_QUEUE && queue_num < QUEUE_SIZE &&
+            (slot = ring_peek(&c->ring->sq)) != NULL) {
+        // the client may write the slot, so check a copy
+        struct disk_request req = *(struct disk_request *) slot->data;
+        if (slot->length != sizeof(req) + req.length || req.length > MAX_LEN) {
+            printf("Error: wrong request in ring of connection %d.\n", k);
+            conn_close(k);
+            return;
+        }
+        queue_add(k, &req, slot->data + sizeof(req));
+        ring_pop(&c->ring->sq);
     }
+}
 
-    return 1;
+// Drain the socket of connection k with a ring.
+// Its client writes to it only to wake disk.c.
+void conn_bell(int k) {
+    char bell[64];
+    int n;
+    while ((n = read(conn[k].fd, bell, sizeof(bell))) > 0)
+        ;
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        conn_close(k);
 }
 
-int read_block() {
-    int c, s;
-    read_c_s(&c, &s);
+// Before sleeping in epoll for 'timeout' ms, spin a while for requests
+//      in rings, then tell their clients to wake disk.c by the socket.
+// Return: timeout of epoll, 0 if a ring has a request.
+int conn_ring_sleep(int timeout) {
+    int rings = 0;
+    for (int k = 0; k < MAX_CONN; k++)
+        if (conn[k].fd >= 0 && conn[k].ring != NULL && !conn[k].closing)
+            rings++;
+    if (rings == 0)
+        return timeout;
+
+    long start = now_us();
+    do {
+        for (int k = 0; k < MAX_CONN; k++)
+            if (conn[k].fd >= 0 && conn[k].ring != NULL && !conn[k].closing &&
+                    ring_peek(&conn[k].ring->sq) != NULL)
+                return 0;
+    } while (now_us() - start < ring_spin());
+    for (int k = 0; k < MAX_CONN; k++)
+        if (conn[k].fd >= 0 && conn[k].ring != NULL && !conn[k].closing &&
+                !ring_sleep(&conn[k].ring->sq))
+            return 0;
+    return timeout;
+}
 
-    char buf[BLOCK_SIZE + 1];
+// Read requests of connection k to queue, until its socket is empty,
+//      or it has CONN_QUEUE requests in queue, or queue is full.
+// A request left in its buffer is queued by a later call.
+void conn_input(int k) {
+    struct connection *c = &conn[k];
+    struct disk_request *req = (struct disk_request *) c->in;
+    while (c->fd >= 0 && !c->closing) {
+        if (c->ring != NULL) {
+            conn_ring_input(k);
+            return;
+        }
+        int need = sizeof(struct disk_request);
+        if (c->in_len >= need) {
+            if (req->length > MAX_LEN) {
+                printf("Error: request of connection %d is too long.\n", k);
+                conn_close(k);
+                return;
+            }
+            need += req->length;
+            if (c->in_len == need && req->op == DISK_OP_RING) {
+                conn_ring(k, req, c->in + sizeof(struct disk_request));
+                c->in_len = 0;
+                continue;
+            }
+            if (c->in_len == need) {    // a whole request
+                if (c->queued >= CONN_QUEUE || queue_num >= QUEUE_SIZE)
+                    return;
+                queue_add(k, req, c->in + sizeof(struct disk_request));
+                c->in_len = 0;
+                continue;
+            }
+        }
+        int n = read(c->fd, c->in + c->in_len, need - c->in_len);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0) {
+            conn_close(k);
+            return;
+        }
+        c->in_len += n;
+    }
+}
 
-    // check location
-    if (c >= CYLINDERS || s >= SECTORS_PC) {
-        printf("=================== output ====================\n");
-        fprintf(disk_log, "No\n");
-        printf("Read: Location exceed\n");
-        return 1;
+// Wait at most 'timeout' ms (-1: forever) for sockets, then accept new
+//      connections, read arrived requests to queue and send replies.
+void conn_poll(int timeout) {
+    struct epoll_event events[MAX_CONN + 1];
+
+    // requests held back by a full queue, and requests in rings
+    for (int k = 0; k < MAX_CONN; k++)
+        if (conn[k].fd >= 0 && (conn[k].in_len > 0 || conn[k].ring != NULL))
+            conn_input(k);
+
+    if (queue_num > 0)      // taken from a ring just now
+        timeout = 0;
+    else if (timeout != 0)
+        timeout = conn_ring_sleep(timeout);
+    int n = epoll_wait(epollfd, events, MAX_CONN + 1, timeout);
+    if (n < 0 && errno != EINTR) {
+        printf("Error: on epoll_wait.\n");
+        exit(-1);
     }
+    for (int k = 0; k < MAX_CONN; k++)
+        if (conn[k].fd >= 0 && conn[k].ring != NULL)
+            ring_awake(&conn[k].ring->sq);
+    for (int i = 0; i < n; i++) {
+        int k = events[i].data.u32;
+        if (k == MAX_CONN) {
+            conn_accept();
+            continue;
+        }
+        if (conn[k].fd < 0)     // closed by an earlier event
+            continue;
+        if (events[i].events & EPOLLOUT)
+            conn_flush(k);
+        if (conn[k].fd >= 0 && conn[k].ring != NULL && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            conn_bell(k);
+        if (conn[k].fd >= 0 && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            conn_input(k);
+    }
+}
 
-    check_file();
+// Read requests to queue.
+// Wait for one request if queue is empty, then take all the requests
+//      which have already arrived, without waiting.
+// If all the clients are gone and queue is empty, return 0.
+int queue_fill() {
+    if (!SOCKET_OPEN) {
+        if (queue_num == 0 && !stdin_closed) {
+            stdin_closed = !read_request_text();
+            if (!stdin_closed)
+                queue_add(-1, &request, payload);
+        }
+        return queue_num > 0;
+    }
+    if (queue_num > 0)
+        conn_poll(0);
+    while (queue_num == 0 && (conn_num > 0 || conn_accepted == 0)) {
+        conn_poll(sync_timeout());
+        if (sync_timeout() == 0)    // the oldest held reply is due
+            sync_file();
+    }
+    if (sync_timeout() == 0)
+        sync_file();
+    return queue_num > 0;
+}
 
-    printf("=================== output ====================\n");
-    print_time(MOVE_DELAY * (abs(c - cur_cylinder)));   // track-to-track time
-    cur_cylinder = c;
+// Return: 1 if request 'req' is a barrier, which no request passes.
+int is_barrier(struct disk_request *req) {
+    return req->op == DISK_OP_EXIT || req->op == DISK_OP_FLUSH;
+}
 
-    int loc;
-    loc = BLOCK_SIZE * (c * SECTORS_PC + s);
-    memcpy(buf, &disk_file[loc], BLOCK_SIZE);
+// Return: 1 if queue entry k may be served before the entries in front of it.
+// An entry never passes a barrier, or an entry on the same blocks
+//      when one of them writes.
+int queue_ready(int k) {
+    struct queue_entry *b = &queue[k];
+    for (int i = 0; i < k; i++) {
+        struct queue_entry *a = &queue[i];
+        if (is_barrier(&a->request) || is_barrier(&b->request))
+            return 0;
+        if (a->first <= b->last && b->first <= a->last &&
+                (is_write(&a->request) || is_write(&b->request)))
+            return 0;
+    }
+    return 1;
+}
 
-    // print and send message
-    fprintf(disk_log, "Yes %s\n", buf);
-    printf("Read completed: %s\n", buf);
-    if (SOCKET_OPEN) {
-        server_write(buf, BLOCK_SIZE);
+// Take the next request from queue to 'request' and 'payload'.
+// An entry which waited for 'deadline' requests goes first.
+// Otherwise, it is chosen by scheduling policy.
+void queue_take() {
+    int cyl[QUEUE_SIZE];
+    int k = -1, ready = 0;
+    for (int i = 0; i < queue_num; i++) {
+        cyl[i] = -1;
+        if (!queue_ready(i))
+            continue;
+        ready++;
+        if (queue[i].first <= queue[i].last)
+            cyl[i] = __request_lba(&queue[i].request, queue[i].payload, 0) / SECTORS_PC;
+        else
+            cyl[i] = cur_cylinder;      // no block to access
+        if (k < 0 && queue[i].age >= deadline)
+            k = i;
     }
+    if (k < 0)
+        k = pick_next(cyl, queue_num, ready > 1);
+
+    request = queue[k].request;
+    memcpy(payload, queue[k].payload, request.length);
+    free(queue[k].payload);
+    cur_conn = queue[k].conn;
+    cur_arrival = queue[k].arrival;
+    cur_arrival_time = queue[k].arrival_time;
+    if (cur_conn >= 0)
+        conn[cur_conn].queued--;
+    for (int i = k; i < queue_num - 1; i++)
+        queue[i] = queue[i + 1];
+    queue_num--;
+    for (int i = 0; i < queue_num; i++)
+        queue[i].age++;
+}
+
+// Show cylinders and sectors per cylinder.
+int show_org() {
+    print_out("=================== output ====================\n");
+    print_log("%d %d\n", CYLINDERS, SECTORS_PC);
+    print_out("%d %d\n", CYLINDERS, SECTORS_PC);
+
+    __u32 org[2] = {CYLINDERS, SECTORS_PC};
+    send_reply(DISK_OK, (char *) org, sizeof(org));
 
     return 1;
 }
 
-int write_block() {
-    int c, s;
-    char buf[BLOCK_SIZE + 1];
-    buf[0] = '\0';
+// Read blocks. ('R' and 'r')
+int read_block() {
+    int vector = request.op == DISK_OP_READV;
+    if (!check_request(vector ? (long) request.count * 4 : 0, "Read"))
+        return 1;
 
-    read_c_s_buf(&c, &s, buf);
+    __u32 lba[DISK_MAX_COUNT];
+    struct iovec iov[DISK_MAX_COUNT];   // the blocks in order of request
 
-    if (strlen(buf) == 0 && !SOCKET_OPEN) {
-        fprintf(disk_log, "No\n");
-        return -1;
+    print_out("=================== output ====================\n");
+    print_time(seek_request());     // track-to-track time
+
+    for (int i = 0; i < request.count; i++)
+        lba[i] = request_lba(i);
+    if (store->map == NULL)
+        store->read(lba, request.count, reply_data);
+    for (int i = 0; i < request.count; i++) {
+        iov[i].iov_base = store->map ? store->map(lba[i]) : reply_data + i * BLOCK_SIZE;
+        iov[i].iov_len = BLOCK_SIZE;
     }
 
-    // check location
-    if (c >= CYLINDERS || s >= SECTORS_PC) {
-        printf("=================== output ====================\n");
-        fprintf(disk_log, "No\n");
-        printf("Write: Location exceed.\n");
-        return 1;
+    // print message
+    if (verbose >= 2 || !SOCKET_OPEN) {
+        for (int i = 0; i < request.count; i++) {
+            print_log("Yes %.*s\n", BLOCK_SIZE, (char *) iov[i].iov_base);
+            print_out("Read completed: %.*s\n", BLOCK_SIZE, (char *) iov[i].iov_base);
+        }
+    } else {
+        print_log("Yes %d\n", request.count);
+        print_out("Read completed: %d blocks\n", request.count);
     }
+    send_reply_v(DISK_OK, iov, request.count);
 
-    check_file();
+    return 1;
+}
 
-    printf("=================== output ====================\n");
-    print_time(MOVE_DELAY * (abs(c - cur_cylinder)));
-    cur_cylinder = c;
+// Write blocks. ('W' and 'w')
+int write_block() {
+    int vector = request.op == DISK_OP_WRITEV;
+    if (!check_request((long) request.count * (vector ? BLOCK_SIZE + 4 : BLOCK_SIZE), "Write"))
+        return 1;
 
-    int loc;
-    loc = BLOCK_SIZE * (c * SECTORS_PC + s);
-    memcpy(&disk_file[loc], buf, BLOCK_SIZE);
+    char *data = vector ? payload + request.count * 4 : payload;
+    __u32 lba[DISK_MAX_COUNT];
 
-    // print and send message
-    fprintf(disk_log, "Yes\n");
-    printf("Write completed.\n");
+    print_out("=================== output ====================\n");
+    print_time(seek_request());
 
-    if (SOCKET_OPEN) {
-        server_write(buf, BLOCK_SIZE);
-    }
+    for (int i = 0; i < request.count; i++)
+        lba[i] = request_lba(i);
+    store->write(lba, request.count, data);
+    unsynced = 1;
+
+    // print and send message
+    print_log("Yes\n");
+    print_out("Write completed.\n");
+    send_reply(DISK_OK, NULL, 0);
 
     return 1;
 }
 
+// Set blocks. ('S')
 int set_block() {
-    int c, s, ch;
-    char buf[BLOCK_SIZE + 1];
-    read_c_s_buf(&c, &s, buf);
-    buf[3] = '\0';
-    ch = atoi(buf);
-
-    // check location
-    if (c >= CYLINDERS || s >= SECTORS_PC) {
-        fprintf(disk_log, "No\n");
-        printf("Write: Location exceed.\n");
+    if (!check_request(1, "Memory set"))
         return 1;
-    }
 
-    check_file();
+    int ch = (__u8) payload[0];
+    __u32 lba[DISK_MAX_COUNT];
 
-    printf("=================== output ====================\n");
-    print_time(MOVE_DELAY * (abs(c - cur_cylinder)));
-    cur_cylinder = c;
+    print_out("=================== output ====================\n");
+    print_time(seek_request());
 
-    int loc;
-    loc = BLOCK_SIZE * (c * SECTORS_PC + s);
+    for (int i = 0; i < request.count; i++)
+        lba[i] = request.lba + i;
+    memset(reply_data, ch, (long) BLOCK_SIZE * request.count);
+    store->write(lba, request.count, reply_data);
+    unsynced = 1;
 
-    memset(&disk_file[loc], ch, BLOCK_SIZE);
+    print_log("Yes\n");
+    print_out("Memory set completed.\n");
+    send_reply(DISK_OK, NULL, 0);
 
-    fprintf(disk_log, "Yes\n");
-    printf("Memory set completed.\n");
+    return 1;
+}
+
+// Show statistics of the connection and of the whole disk. ('T')
+int show_stat() {
+    struct disk_stat s[2];
+    bzero(&s[0], sizeof(s[0]));
+    if (cur_conn >= 0)
+        s[0] = conn[cur_conn].stat;
+    s[1] = stat_all;
+
+    print_out("=================== output ====================\n");
+    if (verbose >= 1) {
+        print_stat("connection", &s[0]);
+        print_stat("disk", &s[1]);
+    }
+    print_log("Yes\n");
+    send_reply(DISK_OK, (char *) s, sizeof(s));
+
+    return 1;
+}
+
+// Flush. ('F')
+// All the writes served before are on storage when it is replied,
+//      and no request passes it in queue.
+int flush_sys() {
+    sync_file();
+    print_out("=================== output ====================\n");
+    print_log("Yes\n");
+    print_out("Flush completed.\n");
+    send_reply(DISK_OK, NULL, 0);
 
     return 1;
 }
 
+// Exit. ('E')
+// A client leaves after the reply, and disk.c exits when no client is left.
+// The held replies are sent first, so that none is lost with the client.
 int exit_sys() {
-    if (strlen(buffer) == 1)
+    if (held_num > 0)
+        sync_file();
+    if (SOCKET_OPEN)
+        conn[cur_conn].closing = 1;
+    send_reply(DISK_OK, NULL, 0);
+    if (!SOCKET_OPEN)
         return 0;
-    else {
-        return -1;
-    }
+    return 1;
 }
 
 int exe_command(char ch) {
     switch (ch) {
-        case 'I':
+        case DISK_OP_INFO:
             return show_org();
-        case 'R':
+        case DISK_OP_READ:
+        case DISK_OP_READV:
             return read_block();
-        case 'W':
+        case DISK_OP_WRITE:
+        case DISK_OP_WRITEV:
             return write_block();
-        case 'E':
+        case DISK_OP_EXIT:
             return exit_sys();
-        case 'S':
+        case DISK_OP_SET:
             return set_block();
+        case DISK_OP_STAT:
+            return show_stat();
+        case DISK_OP_FLUSH:
+            return flush_sys();
         default:
+            send_reply(DISK_ERR_REQUEST, NULL, 0);
             return -1;
     }
 }
 
 void storage_polling() {
     // polling
-    char ch;
     int state = 1;
     cur_cylinder = 0;
     // state = 1: resume
     // state = 0: exit and say Goodbye.
     // state = -1: instruction error
     while (1) {
-        printf("=================== Command ===================\n");
+        print_out("=================== Command ===================\n");
         state = 1;
-        bzero(buffer, MAX_LEN);
-        if (SOCKET_OPEN) {
-            server_read(buffer);  // read the output of fs
-            if (TELNET_TEST) {
-                buffer[strlen(buffer) - 2] = '\0';
-            }
-        } else {
-            fgets(buffer, MAX_LEN, stdin);
-
-            // delete '\n'
-            buffer[strlen(buffer) - 1] = '\0';
 
-            // delete ' '
-            while (buffer[strlen(buffer) - 1] == ' ')
-                buffer[strlen(buffer) - 1] = '\0';
+        // read the requests of fs, and take the next one to serve
+        if (!queue_fill()) {    // closed by fs
+            state = 0;
+        } else {
+            queue_take();
+            state = exe_command(request.op);
         }
 
-        // execute
-        ch = buffer[0];
-        state = exe_command(ch);
-
         if (state == 0) {   // exit
             printf("=================== output ====================\n");
             printf("Goodbye!\n");
+            if (sync_mode != SYNC_NONE)
+                sync_file();
+            printf("Total track-to-track time: %ld (%s)\n", total_time, policy_name[policy]);
+            print_stat("disk", &stat_all);
+            printf("%d syncs to storage (%s, %s)\n", sync_count, sync_name[sync_mode], store->name);
             fprintf(disk_log, "Goodbye\n");
             break;
         }
         if (state == -1) {   // error
-            printf("=================== output ====================\n");
-            printf("Instruction error!\n");
+            print_out("=================== output ====================\n");
+            print_out("Instruction error!\n");
         }
     }
 
     fclose(disk_log);
-    if (SOCKET_OPEN)
-        close(fd);
+    store->close();
 }
 
 int main(int argc, char *argv[]) {
+    int opt;
+
+    // options:
+    //      -p <fcfs|sstf|scan|clook>: scheduling policy
+    //      -d <requests>: deadline of a request in queue
+    //      -t <time>: time for a sector to pass under the head
+    //      -s <none|write|group>: durability of writes
+    //      -n <writes>, -i <ms>: size and age of a group commit
+    //      -b <mmap|pread|uring>: backend of storage file
+    //      -v <level>: verbosity of text output
+    //      -T <file>: binary trace of requests
+    store = storage_find(BACKEND);
+    while ((opt = getopt(argc, argv, "p:d:t:s:n:i:b:v:T:")) != -1) {
+        switch (opt) {
+            case 'p':
+                policy = -1;
+                for (int i = 0; i < 4; i++)
+                    if (strcmp(optarg, policy_name[i]) == 0)
+                        policy = i;
+                if (policy < 0) {
+                    printf("Error: unknown policy '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'd':
+                deadline = atoi(optarg);
+                if (deadline <= 0) {
+                    printf("Error: invalid deadline '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 't':
+                sector_time = atoi(optarg);
+                if (sector_time < 0) {
+                    printf("Error: invalid sector time '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 's':
+                sync_mode = -1;
+                for (int i = 0; i < 3; i++)
+                    if (strcmp(optarg, sync_name[i]) == 0)
+                        sync_mode = i;
+                if (sync_mode < 0) {
+                    printf("Error: unknown durability mode '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'n':
+                group_writes = atoi(optarg);
+                if (group_writes <= 0) {
+                    printf("Error: invalid group size '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'i':
+                group_ms = atoi(optarg);
+                if (group_ms < 0) {
+                    printf("Error: invalid group interval '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'b':
+                store = storage_find(optarg);
+                if (store == NULL) {
+                    printf("Error: unknown backend '%s', use " STORAGE_NAMES ".\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'v':
+                verbose = atoi(optarg);
+                break;
+            case 'T':
+                trace_name = optarg;
+                break;
+            default:
+                printf("Usage: %s [-p policy] [-d requests] [-t time] [-s mode] [-n writes] [-i ms] [-b backend] [-v level] [-T trace] cylinders sectors delay file [address]\n", argv[0]);
+                exit(-1);
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;     // argv[1] ~ argv[5]: disk arguments
 
     input_detect(argc);
 
     storage_init(argv);
 
+    if (trace_name != NULL)
+        trace_init();
+
     if (SOCKET_OPEN) {
         init_server(argv);
     }
 
     storage_polling();
 
+    if (trace_name != NULL)
+        printf("Trace written to '%s', %ld requests dropped.\n", trace_name, trace_close());
+
     if (SOCKET_OPEN) {
-        close(sockfd);
-        close(newsockfd);
+        close(epollfd);
+        transport_close(sockfd, argv[5]);
     }
 
     return 0;
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include "disk_client.h"
+#include "transport.h"
+
+static int sockfd;          // socket with disk.c
+static char message[sizeof(struct disk_request) + DISK_MAX_LEN];
+
+void disk_connect(const char *address) {
+    sockfd = transport_connect(address);
+}
+
+void disk_close() {
+    close(sockfd);
+}
+
+int disk_wait(int ms) {
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+    return poll(&pfd, 1, ms) > 0;
+}
+
+// Write 'length' Bytes to disk.c.
+void disk_write(const char *data, int length) {
+    while (length > 0) {
+        int n = write(sockfd, data, length);
+        if (n <= 0) {
+            printf("Error: writing to socket.\n");
+            exit(-1);
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+// Read 'length' Bytes from disk.c.
+void disk_read(char *data, int length) {
+    while (length > 0) {
+        int n = read(sockfd, data, length);
+        if (n <= 0) {
+            printf("Error: reading from socket.\n");
+            exit(-1);
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+void disk_send(__u8 op, __u32 id, __u32 lba, __u32 count, const char *payload, int length) {
+    struct disk_request r;
+    bzero(&r, sizeof(r));
+    r.op = op;
+    r.id = id;
+    r.lba = lba;
+    r.count = count;
+    r.length = length;
+    memcpy(message, &r, sizeof(r));
+    if (length > 0)
+        memcpy(message + sizeof(r), payload, length);
+    disk_write(message, sizeof(r) + length);
+}
+
+struct disk_reply read_reply(char *data) {
+    struct disk_reply reply;
+    disk_read((char *) &reply, sizeof(reply));
+    if (reply.length > DISK_MAX_LEN) {
+        printf("Error: wrong reply from disk.c.\n");
+        exit(-1);
+    }
+    disk_read(data, reply.length);
+    return reply;
+}
+
+__u64 now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int latency_cmp(const void *a, const void *b) {
+    long x = *(const long *) a, y = *(const long *) b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile(long *sorted, long n, double p) {
+    long k = (long) (p / 100 * n);
+    if (k >= n)
+        k = n - 1;
+    return sorted[k] / 1000.0;
+}
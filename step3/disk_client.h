@@ -0,0 +1,32 @@
+// Client of disk.c for the tools which send requests to it directly,
+//      replay and loadgen.
+//
+// A tool has one connection to disk.c, and requests and replies go
+//      through it as in protocol.h. Errors are reported and exit, as the
+//      rest of the processes do.
+#ifndef DISK_CLIENT_H
+#define DISK_CLIENT_H
+
+#include <asm/types.h>
+#include "protocol.h"
+
+// Connect to disk.c at 'address' (see transport.h).
+void disk_connect(const char *address);
+// Close the connection.
+void disk_close();
+// Wait at most 'ms' ms, or for ever if -1, for a reply.
+// Return: 1 if a reply can be read, 0 if the time is out.
+int disk_wait(int ms);
+// Send a request with 'length' Bytes of 'payload'.
+void disk_send(__u8 op, __u32 id, __u32 lba, __u32 count, const char *payload, int length);
+// Read a reply, and its payload to 'data' of DISK_MAX_LEN Bytes.
+// Return: its header.
+struct disk_reply read_reply(char *data);
+// Return: monotonic time in ns.
+__u64 now_ns();
+// Order latencies (long) for qsort.
+int latency_cmp(const void *a, const void *b);
+// Return: the p-th percentile of n sorted latencies in ns, in us.
+double percentile(long *sorted, long n, double p);
+
+#endif
@@ -15,9 +15,15 @@
 #include <netdb.h>
 #include <pthread.h>
 #include <time.h>
+#include <poll.h>
+#include <errno.h>
+#include <limits.h>
+#include "protocol.h"
+#include "ring.h"
+#include "transport.h"
 
 // An important tip:
-//      While using socket, must use interleaved read and write.
+//      While using socket with client.c, must use interleaved read and write.
 //      Such as: write - read - write - read - ...
 //      Otherwise, if we use write twice in client , the server will
 //      read twice. But the server may only get ONE message instead
@@ -30,6 +36,9 @@
 //      DEADLOCK!
 //      So, we need interleaving read / write operation for the
 //      purpose of realizing communication synchronization.
+//      Messages with disk.c are framed by their lengths and tagged by
+//      request ids instead, so many requests may be in flight and
+//      their replies may come in any order.
 
 // =================================================================
 // Modify this part to get different output type.
@@ -55,46 +64,98 @@
 
 // If TELNET_TEST is 1, use telnet directly to test.
 #define TELNET_TEST 0
+
+// Default budget of the buffer cache (in blocks).
+// It can be changed at startup by '-c <blocks>'.
+#define CACHE_SIZE 256
+
+// Default interval (in seconds) of writing dirty super block and bitmaps.
+// If 0, they are written at the end of each command.
+// Otherwise they are written at the end of a command, or while waiting
+//      for one, once the interval has passed.
+// They are always written at shutdown.
+// It can be changed at startup by '-m <seconds>'.
+#define META_FLUSH_INTERVAL 0
+
+// Default number of inode blocks cached in memory.
+// The cache grows when a command uses more inode blocks than this.
+#define INODE_CACHE_SIZE 64
+
+// Number of data blocks per inode when sizing a disk at format time.
+#define INODE_RATIO 2
+
+// Default number of cylinders of a cylinder group.
+// Each group has its own inode blocks and data blocks, and a new file is
+//      placed in the group of its parent directory.
+// The number of groups can be changed by '-g <groups>' before formatting.
+#define CG_CYLINDERS 2
+
+// The most requests to disk.c in flight at a time.
+// Writes are sent without waiting, and their replies are collected
+//      before the reply of the command to client.c.
+#define DISK_MAX_INFLIGHT 32
+
+// If DISK_RING is 1, requests to disk.c and their replies go through
+//      a shared-memory ring instead of the socket (see ring.h).
+// It can be enabled at startup by '-r'.
+#define DISK_RING 0
 // =================================================================
 
-static int BLOCK_NUM;       // block number
+static int BLOCK_NUM;       // block number, decided at format time
 #define BLOCK_SIZE 256      // block size: 256 Bytes = 2048 bits
-static int INODE_NUM;       // inode number
-#define INODE_SIZE 64       // inode size: 64 Bytes = 512 bits
+static int INODE_NUM;       // inode number, decided at format time
+#define INODE_SIZE 128      // inode size: 128 Bytes = 1024 bits
+#define INODE_PER_BLOCK (BLOCK_SIZE / INODE_SIZE)
 
 #define MAX_LEN 10000       // The maximum length of input
 #define MAX_DATA_LEN 8192   // The maximum length of input data
 #define MAX_PATH_LEN 64     // The maximum length of input path
+#define LS_LINE_LEN 160     // The maximum length of a line of 'ls', with "...\n"
 
 // The i_info of a file inode which has all allowed authority.
 #define INFO_FILE_ALL_ALLOW 0x27e00
 // The i_info of a directory inode which has all allowed authority.
 #define INFO_DIR_ALL_ALLOW 0x27e01
 
+// Magic number and version of the disk format.
+// A disk with another version must be formatted again.
+#define FS_MAGIC 0x53464e49     // "INFS"
+#define FS_VERSION 5
+
+// Type of a directory entry, the same as the lowest bit of i_info.
+#define TYPE_FILE 0
+#define TYPE_DIR 1
+
 // super_block
-// 160 bits
+// 320 bits
 struct b_super_block {
     __u32 s_count_inode;
     __u32 s_count_block;
     __u32 s_count_free_inode;
     __u32 s_count_free_block;
     __u32 s_inode_root;
+    __u32 s_magic;
+    __u32 s_version;
+    __u32 s_cg_num;             // number of cylinder groups
+    __u32 s_cg_inode_block;     // number of inode blocks per cylinder group
+    __u32 s_cg_block;           // number of data blocks per cylinder group
 };
 
-// inode_bitmap
-// 1024 bits
-struct bitmap_inode {
-    __u8 i_valid_bit[128];
-};
-
-// block_bitmap
-// 2048 bits
-struct bitmap_block {
-    __u8 b_valid_bit[256];
+// extent
+// An entry of extent tree.
+//      leaf (level = 0): 'e_len' contiguous blocks from block 'e_start'.
+//      internal node (level > 0): 'e_start' is the child block,
+//          which maps the next 'e_len' virtual blocks.
+// Entries map virtual blocks in order, so the first virtual block of
+//      an entry is the sum of 'e_len' before it.
+// 8 Bytes = 64 bits
+struct extent {
+    __u32 e_start;
+    __u32 e_len;
 };
 
 // i_node
-// 64 Bytes = 512 bits
+// 128 Bytes = 1024 bits
 struct i_node {
     __u32 i_info;               // base information
     __u8 i_name[16];            // file / dir name
@@ -102,59 +163,205 @@ struct i_node {
     __u32 i_time_access;        // access time
     __u32 i_time_modify;        // access time
     __u32 i_time_change;        // change time
-    __u16 i_num_block;          // data block number (except indirect)
+    __u32 i_num_block;          // data block number (except extent node)
     __u16 i_num_link;           // link number
-    __u16 i_inode_parent_dir;   // parent dir
-    __u16 i_block_direct[8];    // direct block
-    __u16 i_block_single;       // single block
-    __u16 i_block_double;       // double block
-    __u16 i_block_triple;       // triple block
+    __u16 i_extent_num;         // number of entries in 'i_extent'
+    __u32 i_inode_parent_dir;   // parent dir
+    __u32 i_extent_depth;       // depth of extent tree, 0: extents in inode
+    struct extent i_extent[9];  // root of extent tree
+    __u32 i_dir_index;          // root of hash index (directory)
+};
+
+// bitmap
+// Inode bitmap or block bitmap, kept in memory after mount.
+// Stored in storage system: 'num_block' blocks of 2048 bits.
+// The bitmap is divided into regions of REGION_WORDS 64-bit words, and
+//      free bits of each region are counted to find free bits quickly.
+// Free bits of each cylinder group are counted as well, to choose a group.
+#define REGION_WORDS 8
+#define BITS_PER_BLOCK (BLOCK_SIZE * 8)
+#define NO_FREE 0xffffffff      // no free inode or block
+// Free blocks kept for the extent and index nodes which one command adds,
+//      so that only data blocks can run out (see 'check_free_block').
+#define RESERVE_BLOCK 32
+struct bitmap {
+    int num;                // number of bits in use (INODE_NUM or BLOCK_NUM)
+    int num_block;          // number of blocks in storage system
+    __u8 *bits;             // num_block * BLOCK_SIZE Bytes
+    __u8 *dirty;            // 1 if the block is newer than disk
+    int *region_free;       // free bits of each region
+    int group_bits;         // bits per cylinder group
+    int *group_free;        // free bits of each cylinder group
+};
+
+// extent_node
+// A block of the extent tree of a file.
+// The root of the tree is kept in inode, with at most EXTENT_ROOT_NUM entries.
+// 256 Bytes = 2048 bits
+#define EXTENT_NODE_NUM 31
+#define EXTENT_ROOT_NUM 9
+struct extent_node {
+    __u16 count;                // number of entries
+    __u16 level;                // 0: leaf
+    __u32 reserved;
+    struct extent entry[EXTENT_NODE_NUM];
+};
+
+// extent_map
+// The leaf of extent tree last used by an inode, so that mapping
+//      the neighbouring blocks does not walk the tree again.
+// Inodes share EXTENT_MAP_SIZE entries by 'i_index % EXTENT_MAP_SIZE'.
+// Not stored in storage system.
+#define EXTENT_MAP_SIZE 64
+struct extent_map {
+    __u8 valid;                 // 1 if 'leaf' is up to date
+    __u32 i_index;              // inode using this entry
+    __u32 v_start;              // first virtual block mapped by 'leaf'
+    __u32 v_len;                // number of virtual blocks mapped by 'leaf'
+    struct extent_node leaf;
 };
 
-// b_block
-// can contain 128 inode/block index
+// index_node
+// A block of the hash index of a directory.
+// The index is a tree ordered by the hash of names:
+//      leaf (level = 0): value is the virtual block index of the
+//          directory block which contains the entry of the name.
+//      internal node (level > 0): value is the child block index,
+//          hash is the lowest hash in that child.
 // 256 Bytes = 2048 bits
-struct b_block {
-    char b_data[256];
+#define INDEX_ENTRY_NUM 31
+struct index_entry {
+    __u32 hash;
+    __u32 value;
+};
+struct index_node {
+    __u16 count;                // number of entries
+    __u16 level;                // 0: leaf
+    __u32 reserved;
+    struct index_entry entry[INDEX_ENTRY_NUM];
+};
+
+// dir_entry
+// An entry of directory: inode index, type, name length and name.
+// Stored in storage system, packed in the blocks of directory:
+//      DIR_ENTRY_HEAD + d_name_len Bytes, without '\0'.
+// An entry never crosses two blocks. Entries of a block are followed by
+//      zeros, so d_name_len == 0 means no more entries in this block.
+#define DIR_ENTRY_HEAD 6
+struct dir_entry {
+    __u32 d_inode;              // inode index
+    __u8 d_type;                // TYPE_FILE / TYPE_DIR
+    __u8 d_name_len;            // 1 ~ 15
+    char d_name[16];            // with '\0' in memory
 };
 
 // index_name
 // A struct of index and its name.
 // Not stored in storage system.
 struct index_name {
-    __u16 index;
+    __u32 index;
     char name[16];
 };
 
+// cache_entry
+// A disk block cached in memory.
+// Not stored in storage system.
+struct cache_entry {
+    int disk_block_index;   // cached disk block
+    __u8 valid;             // 1 if this entry holds a block
+    __u8 dirty;             // 1 if data is newer than disk
+    __u8 ref;               // reference bit of CLOCK
+    int next;               // next entry in the same hash bucket
+    char data[BLOCK_SIZE];
+};
+
+// disk_pending
+// A request sent to disk.c, waiting for its reply.
+// Not stored in storage system.
+struct disk_pending {
+    __u32 id;               // request id
+    __u8 used;              // 1 if this entry holds a request
+    __u8 done;              // 1 if its reply has come
+    __u8 posted;            // 1 if nobody waits for the reply
+    int status;             // status of reply
+    char *reply_data;       // payload of reply is stored here
+    int reply_length;       // the maximum length of payload of reply
+};
+
+// inode_block
+// A block of INODE_PER_BLOCK inodes cached in memory.
+// Blocks used by the current command are never evicted, so a pointer
+//      returned by 'get_inode' stays valid until the command ends.
+// Not stored in storage system.
+struct inode_block {
+    int b;                  // inode block index
+    int command;            // the last command using this block
+    int next;               // next entry in the same hash bucket
+    __u8 dirty[INODE_PER_BLOCK];    // 1 if the inode is newer than disk
+    struct i_node inode[INODE_PER_BLOCK];
+};
+
 static int disk_block_num;      // the total number of disk blocks
 static int cylinders;           // the number of cylinders
 static int sectors_pc;          // the number of sectors per cylinder
+static int cg_num;              // the number of cylinder groups
+static int cg_num_format;       // the number of cylinder groups to format, 0: by geometry
+static int cg_inode_block;      // the number of inode blocks per cylinder group
+static int cg_block;            // the number of data blocks per cylinder group
+static int cg_start;            // the first disk block of cylinder group 0
 static int disk_sockfd;         // socket with disk.c
 static int client_sockfd;       // socket with client.c
 static int client_newsockfd;    // new socket with client.c
-static socklen_t clilen;
-struct sockaddr_in serv_addr;
-struct sockaddr_in cli_addr;
 static char buffer[MAX_LEN];
 static char client_buffer[MAX_LEN];     // buffer read from client.c
 static char client_buffer_w[MAX_LEN];   // buffer write to client.c
-static char disk_buffer[MAX_LEN];       // buffer read from disk.c
-static char disk_buffer_w[MAX_LEN];     // buffer write to disk.c
+static __u32 disk_request_id;           // id of the last request to disk.c
+static struct disk_pending disk_pending[DISK_MAX_INFLIGHT]; // requests in flight
+static int disk_pending_num;            // number of requests in flight
+static int disk_pending_max;            // the most requests in flight at a time
+static long disk_time;                  // simulated time of requests, told by disk.c
+static int use_ring = DISK_RING;        // 1 if the ring is asked for
+static struct ring_shm *disk_ring;      // shared-memory ring with disk.c, NULL if not used
 
 static struct b_super_block super_block;    // super block
-static struct bitmap_inode inode_bitmap;    // inode bitmap
-static struct bitmap_block block_bitmap;    // block_bitmap
-static struct i_node inode[1024];   // inodes
-static struct b_block block[2048];  // blocks
+static struct bitmap inode_bitmap;  // inode bitmap
+static struct bitmap block_bitmap;  // block bitmap
 static FILE *fs_log;                // file id of fs.log
-static __u16 cur_dir;               // current directory
+static __u32 cur_dir;               // current directory
 static int cur_usr = 0;                 // current user
 
+static int cache_size = CACHE_SIZE;     // number of cache entries
+static struct cache_entry *cache;       // buffer cache
+static int *cache_bucket;               // first entry of each hash bucket
+static int cache_hand;                  // hand of CLOCK
+static int cache_hit;                   // read hits
+static int cache_miss;                  // read misses
+static int cache_write_back;            // blocks written back to disk.c
+static int *cache_flush_list;           // dirty entries sorted by 'cache_flush'
+
+static int inode_cache_size;            // number of inode cache entries
+static struct inode_block **inode_cache;    // inode cache
+static int inode_bucket[INODE_CACHE_SIZE];  // first entry of each hash bucket
+static int inode_hand;                  // next entry to check for eviction
+static int command_count;               // commands executed
+static int inode_write;                 // inode writes requested
+static int inode_write_block;           // inode blocks actually written
+
+static struct extent_map extent_map[EXTENT_MAP_SIZE];  // extent maps of inodes
+static int extent_map_hit;              // blocks mapped by memoized leaf
+static int extent_map_miss;             // blocks mapped by walking the tree
+
+static __u8 super_block_dirty;          // 1 if super block is newer than disk
+static int meta_flush_interval = META_FLUSH_INTERVAL;
+static time_t meta_flush_time;          // last time of 'meta_flush'
+
 // Write to client.c.
+// client.c leaves without reading the output of 'e', so a peer gone is
+//      no error, and must not raise SIGPIPE (at once on a Unix-domain socket).
 void server_write() {
-    int n = write(client_newsockfd, client_buffer_w, strlen(client_buffer_w));
+    int n = send(client_newsockfd, client_buffer_w, strlen(client_buffer_w), MSG_NOSIGNAL);
     bzero(client_buffer_w, MAX_LEN);
-    if (n < 0) {
+    if (n < 0 && errno != EPIPE && errno != ECONNRESET) {
         printf("Error: writing to socket.\n");
         exit(-1);
     }
@@ -171,130 +378,682 @@ void server_read(char buffer[MAX_LEN]) {
     printf("%s", buffer);
 }
 
-// Write to disk.c. (disk_buffer_w)
-void client_write(int length) {
-    int n = write(disk_sockfd, disk_buffer_w, length);
-    if (n < 0) {
-        printf("Error: writing to socket.\n");
+// Read 'length' Bytes from disk.c.
+void client_read(char *data, int length) {
+    while (length > 0) {
+        int n = read(disk_sockfd, data, length);
+        if (n < 0) {
+            printf("Error: reading from socket.\n");
+            exit(-1);
+        }
+        if (n == 0) {
+            printf("Error: disk.c closed the socket.\n");
+            exit(-1);
+        }
+        data += n;
+        length -= n;
+    }
+}
+
+// Wait for a reply in the ring.
+// disk.c writes nothing to the socket after the ring is set up,
+//      so the socket is readable only if disk.c is gone.
+void disk_ring_wait() {
+    ring_wait(&disk_ring->cq, 100);
+    struct pollfd pfd = {disk_sockfd, POLLIN, 0};
+    if (ring_peek(&disk_ring->cq) == NULL && poll(&pfd, 1, 0) > 0) {
+        printf("Error: disk.c closed the socket.\n");
         exit(-1);
     }
 }
 
-// Read from disk.c. (disk_buffer)
-void client_read() {
-    int n = read(disk_sockfd, disk_buffer, MAX_LEN);
-    if (n < 0) {
-        printf("Error: reading from socket.\n");
+// Read a reply from disk.c, in any order, and complete its request.
+// The payload of reply is stored in 'reply_data' of the request.
+void disk_complete() {
+    struct disk_reply reply;
+    struct ring_slot *slot = NULL;
+    if (disk_ring != NULL) {
+        while ((slot = ring_peek(&disk_ring->cq)) == NULL)
+            disk_ring_wait();
+        memcpy(&reply, slot->data, sizeof(reply));
+    } else {
+        client_read((char *) &reply, sizeof(reply));
+    }
+
+    int k = 0;
+    while (k < DISK_MAX_INFLIGHT && !(disk_pending[k].used && disk_pending[k].id == reply.id))
+        k++;
+    if (k == DISK_MAX_INFLIGHT || reply.length > disk_pending[k].reply_length ||
+            (slot != NULL && slot->length != sizeof(reply) + reply.length)) {
+        printf("Error: wrong reply from disk.c.\n");
         exit(-1);
     }
+    struct disk_pending *p = &disk_pending[k];
+    if (slot != NULL) {
+        memcpy(p->reply_data, slot->data + sizeof(reply), reply.length);
+        ring_pop(&disk_ring->cq);
+    } else {
+        client_read(p->reply_data, reply.length);
+    }
+    p->status = reply.status;
+    disk_time += reply.time;
+    p->done = 1;
+    disk_pending_num--;
+
+    // nobody waits for a posted write
+    if (p->posted) {
+        if (p->status != DISK_OK)
+            printf("Error: disk.c failed to write, status %d.\n", p->status);
+        p->used = 0;
+    }
+}
+
+// Write 'length' Bytes to disk.c.
+// Replies arriving meanwhile are collected, so that disk.c never waits
+//      for us to read while we wait for it to read.
+void client_write(const char *data, int length) {
+    while (length > 0) {
+        struct pollfd pfd = {disk_sockfd, POLLIN | POLLOUT, 0};
+        if (disk_pending_num == 0)
+            pfd.events = POLLOUT;
+        if (poll(&pfd, 1, -1) < 0) {
+            printf("Error: polling socket.\n");
+            exit(-1);
+        }
+        if (pfd.revents & POLLIN) {
+            disk_complete();
+            continue;
+        }
+        int n = write(disk_sockfd, data, length);
+        if (n < 0) {
+            printf("Error: writing to socket.\n");
+            exit(-1);
+        }
+        data += n;
+        length -= n;
+    }
 }
 
-// Write a block to disk.c.
-// Already store the data in 'disk_buffer_w'.
+// Send a request with 'length' Bytes of 'data' to disk.c without waiting
+//      for its reply. The payload of reply will be stored in 'reply_data'.
+// If 'posted' is 1, nobody will wait for the reply (only for writes).
+// At most DISK_MAX_INFLIGHT requests are in flight.
+// Return: id of the request, for 'disk_wait'.
+__u32 disk_submit(__u8 op, __u32 lba, int count, const char *data, int length,
+                  char *reply_data, int reply_length, int posted) {
+    static char message[sizeof(struct disk_request) + DISK_MAX_LEN];
+    struct disk_request request;
+
+    int k = 0;
+    while (1) {
+        while (k < DISK_MAX_INFLIGHT && disk_pending[k].used)
+            k++;
+        if (k < DISK_MAX_INFLIGHT)
+            break;
+        disk_complete();
+        k = 0;
+    }
+
+    bzero(&request, sizeof(request));
+    request.op = op;
+    request.id = ++disk_request_id;
+    request.lba = lba;
+    request.count = count;
+    request.length = length;
+
+    struct disk_pending *p = &disk_pending[k];
+    p->used = 1;
+    p->done = 0;
+    p->posted = posted;
+    p->id = request.id;
+    p->reply_data = reply_data;
+    p->reply_length = reply_length;
+    disk_pending_num++;
+    if (disk_pending_num > disk_pending_max)
+        disk_pending_max = disk_pending_num;
+
+    if (disk_ring != NULL) {
+        // a slot is taken only by a request in flight, so one is free
+        struct ring_slot *slot = ring_next(&disk_ring->sq);
+        if (slot == NULL) {
+            printf("Error: ring of disk.c is full.\n");
+            exit(-1);
+        }
+        memcpy(slot->data, &request, sizeof(request));
+        if (length > 0)
+            memcpy(slot->data + sizeof(request), data, length);
+        slot->length = sizeof(request) + length;
+        if (ring_push(&disk_ring->sq))      // wake disk.c
+            client_write("!", 1);
+        return request.id;
+    }
+    memcpy(message, &request, sizeof(request));
+    if (length > 0)
+        memcpy(message + sizeof(request), data, length);
+    client_write(message, sizeof(request) + length);
+    return request.id;
+}
+
+// Wait for the reply of request 'id', collecting other replies meanwhile.
+// Return: status of the reply.
+int disk_wait(__u32 id) {
+    int k = 0;
+    while (k < DISK_MAX_INFLIGHT && !(disk_pending[k].used && disk_pending[k].id == id))
+        k++;
+    if (k == DISK_MAX_INFLIGHT) {
+        printf("Error: no request %u to disk.c.\n", id);
+        exit(-1);
+    }
+    while (!disk_pending[k].done)
+        disk_complete();
+    disk_pending[k].used = 0;
+    return disk_pending[k].status;
+}
+
+// Wait until all the requests in flight are completed.
+void disk_drain() {
+    while (disk_pending_num > 0)
+        disk_complete();
+}
+
+// Send a request with 'length' Bytes of 'data' to disk.c, and wait for
+//      its reply. The payload of reply is stored in 'reply_data'.
+// Return: status of the reply.
+int disk_call(__u8 op, __u32 lba, int count, const char *data, int length,
+              char *reply_data, int reply_length) {
+    return disk_wait(disk_submit(op, lba, count, data, length, reply_data, reply_length, 0));
+}
+
+// Send a block to disk.c, without waiting for the write.
+// disk.c never serves a later request on the block before it.
 //      If exceed disk capacity, return 0.
-//      If write completed, return 1.
-int write_to_disk(int disk_block_index) {
+//      If write is sent, return 1.
+int write_to_disk(int disk_block_index, char data[BLOCK_SIZE]) {
     if (disk_block_index >= disk_block_num)
         return 0;
 
-    // W c s data
-    int c = disk_block_index / sectors_pc;
-    int s = disk_block_index % sectors_pc;
-    char c_str[64], s_str[64], tmp[MAX_LEN];
-    sprintf(c_str, "%d ", c);
-    sprintf(s_str, "%d ", s);
-    sprintf(tmp, "W ");
-    int length = BLOCK_SIZE + strlen(tmp) + strlen(c_str) + strlen(s_str) + 1;
-
-    strcat(tmp, c_str);
-    strcat(tmp, s_str);
-    memcpy(tmp + strlen(tmp), disk_buffer_w, BLOCK_SIZE);
-    bzero(disk_buffer_w, MAX_LEN);
-    memcpy(disk_buffer_w, tmp, length - 1);
-    disk_buffer_w[length - 1] = '\n';
-    disk_buffer_w[length] = '\0';
-
-    // write command to disk.c
-    client_write(length);
-    bzero(disk_buffer_w, MAX_LEN);
-
-    // wait for output from disk.c
-    bzero(disk_buffer, MAX_LEN);
-    client_read();
-
+    disk_submit(DISK_OP_WRITE, disk_block_index, 1, data, BLOCK_SIZE, NULL, 0, 1);
     return 1;
 }
 
 // Read a block from disk.c.
-// Data will be stored in 'disk_buffer'.
+// Data will be stored in 'data'.
 //      If exceed disk capacity, return 0.
 //      If read completed, return 1.
-int read_from_disk(int disk_block_index) {
+int read_from_disk(int disk_block_index, char data[BLOCK_SIZE]) {
     if (disk_block_index >= disk_block_num)
         return 0;
 
-    // R c s
-    int c = disk_block_index / sectors_pc;
-    int s = disk_block_index % sectors_pc;
-    char c_str[64], s_str[64];
-    bzero(disk_buffer_w, MAX_LEN);
-    sprintf(c_str, "%d ", c);
-    sprintf(s_str, "%d", s);
-    sprintf(disk_buffer_w, "R ");
+    return disk_call(DISK_OP_READ, disk_block_index, 1, NULL, 0, data, BLOCK_SIZE) == DISK_OK;
+}
+
+// Return: 1 if the n blocks are contiguous.
+int is_contiguous(int disk_block_index[], int n) {
+    for (int i = 1; i < n; i++)
+        if (disk_block_index[i] != disk_block_index[0] + i)
+            return 0;
+    return 1;
+}
+
+// Send n blocks to disk.c by one request, without waiting for the write.
+// Block i is 'disk_block_index[i]', and its data is 'data + i * BLOCK_SIZE'.
+// Contiguous blocks are written by 'W', others by 'w' with their LBAs.
+//      If write is sent, return 1.
+int write_to_disk_v(int disk_block_index[], int n, char *data) {
+    static char payload[DISK_MAX_LEN];
+    if (is_contiguous(disk_block_index, n)) {
+        disk_submit(DISK_OP_WRITE, disk_block_index[0], n, data, n * BLOCK_SIZE, NULL, 0, 1);
+        return 1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        __u32 lba = disk_block_index[i];
+        memcpy(payload + i * 4, &lba, 4);
+    }
+    memcpy(payload + n * 4, data, n * BLOCK_SIZE);
+    disk_submit(DISK_OP_WRITEV, 0, n, payload, n * (4 + BLOCK_SIZE), NULL, 0, 1);
+    return 1;
+}
+
+// Read n blocks from disk.c by one request.
+// Block i is 'disk_block_index[i]', and its data is stored in
+//      'data + i * BLOCK_SIZE'.
+// Contiguous blocks are read by 'R', others by 'r' with their LBAs.
+//      If read completed, return 1.
+int read_from_disk_v(int disk_block_index[], int n, char *data) {
+    __u32 lba[DISK_MAX_COUNT];
+    if (is_contiguous(disk_block_index, n))
+        return disk_call(DISK_OP_READ, disk_block_index[0], n,
+                         NULL, 0, data, n * BLOCK_SIZE) == DISK_OK;
+
+    for (int i = 0; i < n; i++)
+        lba[i] = disk_block_index[i];
+    return disk_call(DISK_OP_READV, 0, n, (char *) lba, n * 4, data, n * BLOCK_SIZE) == DISK_OK;
+}
+
+// Initialize buffer cache.
+void cache_init() {
+    cache = (struct cache_entry *) malloc(cache_size * sizeof(struct cache_entry));
+    cache_bucket = (int *) malloc(cache_size * sizeof(int));
+    cache_flush_list = (int *) malloc(cache_size * sizeof(int));
+    if (cache == NULL || cache_bucket == NULL || cache_flush_list == NULL) {
+        printf("Error: Could not allocate buffer cache.\n");
+        exit(-1);
+    }
+    for (int i = 0; i < cache_size; i++) {
+        cache[i].valid = 0;
+        cache[i].dirty = 0;
+        cache[i].ref = 0;
+        cache[i].next = -1;
+        cache_bucket[i] = -1;
+    }
+    cache_hand = 0;
+}
 
-    strcat(disk_buffer_w, c_str);
-    strcat(disk_buffer_w, s_str);
+// Find the cache entry of a disk block.
+// If not cached, return -1.
+int cache_find(int disk_block_index) {
+    int e = cache_bucket[disk_block_index % cache_size];
+    while (e >= 0 && cache[e].disk_block_index != disk_block_index)
+        e = cache[e].next;
+    return e;
+}
 
-    // write command to disk.c
-    client_write(strlen(disk_buffer_w));
-    bzero(disk_buffer_w, MAX_LEN);
+// Remove entry 'e' from its hash bucket.
+void cache_unlink(int e) {
+    int *p = &cache_bucket[cache[e].disk_block_index % cache_size];
+    while (*p != e)
+        p = &cache[*p].next;
+    *p = cache[e].next;
+}
 
-    // read from disk.c to act as a division
-    // This is to avoid the case mentioned at row 19.
-    bzero(disk_buffer, MAX_LEN);
-    client_read();
+// Write entry 'e' to disk.c if it is dirty.
+void cache_write_entry(int e) {
+    if (!cache[e].valid || !cache[e].dirty)
+        return;
+    write_to_disk(cache[e].disk_block_index, cache[e].data);
+    cache[e].dirty = 0;
+    cache_write_back++;
+}
 
+// Get a free entry by CLOCK.
+// The victim is written back before reused.
+int cache_evict() {
+    while (1) {
+        int e = cache_hand;
+        cache_hand = (cache_hand + 1) % cache_size;
+        if (!cache[e].valid)
+            return e;
+        if (cache[e].ref) {     // second chance
+            cache[e].ref = 0;
+            continue;
+        }
+        cache_write_entry(e);
+        cache_unlink(e);
+        cache[e].valid = 0;
+        return e;
+    }
+}
+
+// Put disk block into entry 'e'.
+void cache_insert(int e, int disk_block_index) {
+    int bucket = disk_block_index % cache_size;
+    cache[e].disk_block_index = disk_block_index;
+    cache[e].valid = 1;
+    cache[e].dirty = 0;
+    cache[e].ref = 1;
+    cache[e].next = cache_bucket[bucket];
+    cache_bucket[bucket] = e;
+}
+
+// Read a block through buffer cache.
+// Data will be stored in 'data'.
+//      If exceed disk capacity, return 0.
+//      If read completed, return 1.
+int cache_read(int disk_block_index, char data[BLOCK_SIZE]) {
+    if (disk_block_index >= disk_block_num)
+        return 0;
+
+    int e = cache_find(disk_block_index);
+    if (e >= 0) {
+        cache_hit++;
+        cache[e].ref = 1;
+    } else {
+        cache_miss++;
+        e = cache_evict();
+        read_from_disk(disk_block_index, cache[e].data);
+        cache_insert(e, disk_block_index);
+    }
+    memcpy(data, cache[e].data, BLOCK_SIZE);
+    return 1;
+}
+
+// Write a block through buffer cache.
+// The block is only marked dirty, and written to disk.c by 'cache_flush'.
+//      If exceed disk capacity, return 0.
+//      If write completed, return 1.
+int cache_write(int disk_block_index, char data[BLOCK_SIZE]) {
+    if (disk_block_index >= disk_block_num)
+        return 0;
+
+    int e = cache_find(disk_block_index);
+    if (e >= 0) {
+        cache[e].ref = 1;
+    } else {
+        e = cache_evict();
+        cache_insert(e, disk_block_index);
+    }
+    memcpy(cache[e].data, data, BLOCK_SIZE);
+    cache[e].dirty = 1;
     return 1;
 }
 
+// Compare two cache entries by disk block index, for qsort.
+int cache_cmp(const void *a, const void *b) {
+    return cache[*(const int *) a].disk_block_index - cache[*(const int *) b].disk_block_index;
+}
+
+// Write all the dirty blocks to disk.c, DISK_MAX_COUNT blocks a request.
+// The requests are all sent before any reply is waited for.
+void cache_flush() {
+    if (!SOCKET_OPEN)
+        return;
+    static char data[DISK_MAX_COUNT * BLOCK_SIZE];
+    int index[DISK_MAX_COUNT];
+    int num = 0;
+    for (int e = 0; e < cache_size; e++)
+        if (cache[e].valid && cache[e].dirty)
+            cache_flush_list[num++] = e;
+
+    // in order of disk blocks, so that neighbouring blocks go together
+    qsort(cache_flush_list, num, sizeof(int), cache_cmp);
+
+    for (int i = 0; i < num; i += DISK_MAX_COUNT) {
+        int n = num - i < DISK_MAX_COUNT ? num - i : DISK_MAX_COUNT;
+        for (int j = 0; j < n; j++) {
+            int e = cache_flush_list[i + j];
+            index[j] = cache[e].disk_block_index;
+            memcpy(data + j * BLOCK_SIZE, cache[e].data, BLOCK_SIZE);
+            cache[e].dirty = 0;
+        }
+        write_to_disk_v(index, n, data);
+        cache_write_back += n;
+    }
+    disk_drain();
+}
+
+// Read the blocks in 'disk_block_index' which are not in buffer cache,
+//      by one request to disk.c.
+// At most DISK_MAX_COUNT blocks.
+void cache_prefetch(int disk_block_index[], int n) {
+    static char data[DISK_MAX_COUNT * BLOCK_SIZE];
+    int miss[DISK_MAX_COUNT];
+    int num = 0;
+    for (int i = 0; i < n; i++) {
+        int b = disk_block_index[i];
+        if (b >= disk_block_num || cache_find(b) >= 0)
+            continue;
+        int j = 0;
+        while (j < num && miss[j] != b)
+            j++;
+        if (j == num)
+            miss[num++] = b;
+    }
+    if (num == 0)
+        return;
+
+    read_from_disk_v(miss, num, data);
+    cache_miss += num;
+    for (int i = 0; i < num; i++) {
+        int e = cache_evict();
+        memcpy(cache[e].data, data + i * BLOCK_SIZE, BLOCK_SIZE);
+        cache_insert(e, miss[i]);
+    }
+}
+
+// Set the layout of 'num' cylinder groups, each with 'inode_block' inode
+//      blocks and 'data_block' data blocks.
+// Each group has its inode blocks in front of its data blocks:
+//      super block | inode bitmap | block bitmap | group 0 | group 1 | ...
+void set_cylinder_group(int num, int inode_block, int data_block) {
+    cg_num = num;
+    cg_inode_block = inode_block;
+    cg_block = data_block;
+    INODE_NUM = num * inode_block * INODE_PER_BLOCK;
+    BLOCK_NUM = num * data_block;
+    cg_start = 1 + (INODE_NUM + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK
+                 + (BLOCK_NUM + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+}
+
+// Decide the layout of a new disk from disk geometry.
+// The disk is divided into groups of about CG_CYLINDERS cylinders,
+//      or 'cg_num_format' groups if given, and each group has an inode
+//      for every INODE_RATIO data blocks.
+void set_layout() {
+    // bitmaps never need more blocks than this
+    int bitmap_block = (disk_block_num + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    int usable = disk_block_num - 1 - 2 * bitmap_block;
+    int num = cg_num_format;
+    if (num <= 0)
+        num = disk_block_num / (CG_CYLINDERS * sectors_pc);
+    if (num > usable / 2)   // at least an inode block and a data block
+        num = usable / 2;
+    if (num < 1)
+        num = 1;
+
+    int size = usable / num;
+    int inode_block = size / (1 + INODE_PER_BLOCK * INODE_RATIO);
+    if (inode_block < 1)
+        inode_block = 1;
+    int data_block = size - inode_block;
+    set_cylinder_group(num, inode_block, data_block);
+}
+
+// Return: the disk block index of the b-th inode block.
+int inode_disk_block(int b) {
+    return cg_start + b / cg_inode_block * (cg_inode_block + cg_block) + b % cg_inode_block;
+}
+
+// Return: the disk block index of data block 'index'.
+int data_disk_block(int index) {
+    return cg_start + index / cg_block * (cg_inode_block + cg_block) + cg_inode_block + index % cg_block;
+}
+
+// Return: the first data block of the cylinder group of inode 'i_index'.
+int inode_group_block(int i_index) {
+    return i_index / (cg_inode_block * INODE_PER_BLOCK) * cg_block;
+}
+
+// Return: the first data block of the cylinder group of block 'b_index'.
+int block_group_block(int b_index) {
+    return b_index / cg_block * cg_block;
+}
+
+// Drop all the inode blocks in inode cache without writing them.
+void inode_cache_reset() {
+    for (int e = 0; e < inode_cache_size; e++)
+        free(inode_cache[e]);
+    free(inode_cache);
+    inode_cache = NULL;
+    inode_cache_size = 0;
+    inode_hand = 0;
+    for (int i = 0; i < INODE_CACHE_SIZE; i++)
+        inode_bucket[i] = -1;
+}
+
+// Find the inode cache entry of inode block 'b'.
+// If not cached, return -1.
+int inode_cache_find(int b) {
+    int e = inode_bucket[b % INODE_CACHE_SIZE];
+    while (e >= 0 && inode_cache[e]->b != b)
+        e = inode_cache[e]->next;
+    return e;
+}
+
+// Remove entry 'e' from its hash bucket.
+void inode_cache_unlink(int e) {
+    int *p = &inode_bucket[inode_cache[e]->b % INODE_CACHE_SIZE];
+    while (*p != e)
+        p = &inode_cache[*p]->next;
+    *p = inode_cache[e]->next;
+}
+
+// Write entry 'e' to buffer cache if it has dirty inodes.
+void inode_write_entry(int e) {
+    struct inode_block *p = inode_cache[e];
+    int dirty = 0;
+    for (int j = 0; j < INODE_PER_BLOCK; j++)
+        dirty = dirty || p->dirty[j];
+    if (!dirty)
+        return;
+    char data[BLOCK_SIZE];
+    for (int j = 0; j < INODE_PER_BLOCK; j++)
+        memcpy(data + j * INODE_SIZE, &p->inode[j], INODE_SIZE);
+    if (cache_write(inode_disk_block(p->b), data) == 0)
+        printf("Error: exceed!\n");
+    memset(p->dirty, 0, INODE_PER_BLOCK);
+    inode_write_block++;
+}
+
+// Get an unused entry of inode cache.
+// The victim is an entry not used by the current command, written back
+//      before reused. If every entry is in use, the cache grows until
+//      the command ends (see 'inode_cache_trim').
+int inode_cache_evict() {
+    if (inode_cache_size >= INODE_CACHE_SIZE && SOCKET_OPEN) {
+        for (int k = 0; k < inode_cache_size; k++) {
+            int e = inode_hand;
+            inode_hand = (inode_hand + 1) % inode_cache_size;
+            if (inode_cache[e]->command == command_count)
+                continue;
+            inode_write_entry(e);
+            inode_cache_unlink(e);
+            return e;
+        }
+    }
+
+    // entries never move, so pointers to inodes stay valid
+    struct inode_block **p = (struct inode_block **)
+            realloc(inode_cache, (inode_cache_size + 1) * sizeof(struct inode_block *));
+    if (p == NULL) {
+        printf("Error: Could not allocate inode cache.\n");
+        exit(-1);
+    }
+    inode_cache = p;
+    inode_cache[inode_cache_size] = (struct inode_block *) malloc(sizeof(struct inode_block));
+    if (inode_cache[inode_cache_size] == NULL) {
+        printf("Error: Could not allocate inode cache.\n");
+        exit(-1);
+    }
+    return inode_cache_size++;
+}
+
+// Return: inode 'i_index' in inode cache.
+// Its block is read through buffer cache if not cached.
+struct i_node *get_inode(int i_index) {
+    int b = i_index / INODE_PER_BLOCK;
+    int e = inode_cache_find(b);
+    if (e < 0) {
+        char data[BLOCK_SIZE];
+        bzero(data, BLOCK_SIZE);
+        if (SOCKET_OPEN && cache_read(inode_disk_block(b), data) == 0)
+            printf("Error: exceed!\n");
+
+        e = inode_cache_evict();
+        struct inode_block *p = inode_cache[e];
+        for (int j = 0; j < INODE_PER_BLOCK; j++)
+            memcpy(&p->inode[j], data + j * INODE_SIZE, INODE_SIZE);
+        memset(p->dirty, 0, INODE_PER_BLOCK);
+        p->b = b;
+        p->next = inode_bucket[b % INODE_CACHE_SIZE];
+        inode_bucket[b % INODE_CACHE_SIZE] = e;
+    }
+    inode_cache[e]->command = command_count;
+    return &inode_cache[e]->inode[i_index % INODE_PER_BLOCK];
+}
+
+// Mark an inode dirty.
+// Inodes in the same block are merged and written once by 'inode_flush'.
+void inode_mark_dirty(int i_index) {
+    get_inode(i_index);
+    inode_write++;
+    inode_cache[inode_cache_find(i_index / INODE_PER_BLOCK)]->dirty[i_index % INODE_PER_BLOCK] = 1;
+}
+
+// Write all the dirty inode blocks to buffer cache, each block once.
+void inode_flush() {
+    if (!SOCKET_OPEN)
+        return;
+    for (int e = 0; e < inode_cache_size; e++)
+        inode_write_entry(e);
+}
+
+// Shrink inode cache back to INODE_CACHE_SIZE entries after a command
+//      which has grown it, so that the hash chains stay short.
+// The entries are written back by 'inode_flush' before.
+// Without storage system, inode cache holds the inodes and never shrinks.
+void inode_cache_trim() {
+    if (inode_cache_size <= INODE_CACHE_SIZE || !SOCKET_OPEN)
+        return;
+    for (int e = INODE_CACHE_SIZE; e < inode_cache_size; e++) {
+        inode_cache_unlink(e);
+        free(inode_cache[e]);
+    }
+    inode_cache_size = INODE_CACHE_SIZE;
+    struct inode_block **p = (struct inode_block **)
+            realloc(inode_cache, inode_cache_size * sizeof(struct inode_block *));
+    if (p != NULL)
+        inode_cache = p;
+    inode_hand %= inode_cache_size;
+}
+
+// Read data block 'b_index' through buffer cache.
+void read_block(__u32 b_index, char data[BLOCK_SIZE]) {
+    bzero(data, BLOCK_SIZE);
+    if (!SOCKET_OPEN)
+        return;
+    if (cache_read(data_disk_block(b_index), data) == 0)
+        printf("Error: exceed!\n");
+}
+
+// Write data block 'b_index' through buffer cache.
+void write_block(__u32 b_index, char data[BLOCK_SIZE]) {
+    if (!SOCKET_OPEN)
+        return;
+    if (cache_write(data_disk_block(b_index), data) == 0)
+        printf("Error: exceed!\n");
+}
+
 // Write something to disk.c.
 //      fg = 0: super block
-//      fg = 1: inode bitmap
-//      fg = 2: block bitmap
+//      fg = 1: the index-th block of inode bitmap
+//      fg = 2: the index-th block of block bitmap
 //      fg = 3: inode
-//      fg = 4: block
 void write_disk(int fg, int index) {
     if (!SOCKET_OPEN)
         return;
-    bzero(disk_buffer_w, MAX_LEN);
+    if (fg == 3) {      // inode: delayed until 'inode_flush'
+        inode_mark_dirty(index);
+        return;
+    }
+    char data[BLOCK_SIZE];
+    bzero(data, BLOCK_SIZE);
     int disk_block_index;
     switch (fg) {
         case 0:     // super block
             disk_block_index = 0;
-            memcpy(disk_buffer_w, &super_block, 4 * 5);
+            memcpy(data, &super_block, 4 * 10);
             break;
         case 1:     // inode bitmap
-            disk_block_index = 1;
-            memcpy(disk_buffer_w, inode_bitmap.i_valid_bit, 128);
+            disk_block_index = 1 + index;
+            memcpy(data, inode_bitmap.bits + index * BLOCK_SIZE, BLOCK_SIZE);
             break;
         case 2:     // block bitmap
-            disk_block_index = 2;
-            memcpy(disk_buffer_w, block_bitmap.b_valid_bit, 256);
-            break;
-        case 3:     // inode
-            index = index / 4;      // 1 block contains 4 inodes
-            disk_block_index = 3 + index;
-            memcpy(disk_buffer_w, &inode[index * 4], 64);
-            memcpy(disk_buffer_w + 64, &inode[index * 4 + 1], 64);
-            memcpy(disk_buffer_w + 128, &inode[index * 4 + 2], 64);
-            memcpy(disk_buffer_w + 192, &inode[index * 4 + 3], 64);
-            break;
-        case 4:     // block
-            disk_block_index = 3 + INODE_NUM / 4 + index;
-            memcpy(disk_buffer_w, &block[index], 256);
+            disk_block_index = 1 + inode_bitmap.num_block + index;
+            memcpy(data, block_bitmap.bits + index * BLOCK_SIZE, BLOCK_SIZE);
     }
 
-    int ret = write_to_disk(disk_block_index);
+    int ret = cache_write(disk_block_index, data);
     if (ret == 0) {
         printf("Error: exceed!\n");
     }
@@ -302,14 +1061,17 @@ void write_disk(int fg, int index) {
 
 // Read something from disk.c.
 //      fg = 0: super block
-//      fg = 1: inode bitmap
-//      fg = 2: block bitmap
+//      fg = 1: the index-th block of inode bitmap
+//      fg = 2: the index-th block of block bitmap
 //      fg = 3: inode
-//      fg = 4: block
 void read_disk(int fg, int index) {
     if (!SOCKET_OPEN)
         return;
-    bzero(disk_buffer_w, MAX_LEN);
+    if (fg == 3) {      // inode: read by inode cache
+        get_inode(index);
+        return;
+    }
+    char data[BLOCK_SIZE];
     int disk_block_index;
 
     // calculate disk block index
@@ -318,83 +1080,115 @@ void read_disk(int fg, int index) {
             disk_block_index = 0;
             break;
         case 1:     // inode bitmap
-            disk_block_index = 1;
+            disk_block_index = 1 + index;
             break;
         case 2:     // block bitmap
-            disk_block_index = 2;
-            break;
-        case 3:     // inode
-            index = index / 4;      // 1 block contains 4 inodes
-            disk_block_index = 3 + index;
-            break;
-        case 4:     // block
-            disk_block_index = 3 + INODE_NUM / 4 + index;
+            disk_block_index = 1 + inode_bitmap.num_block + index;
     }
 
-    // read a block from disk
-    int ret = read_from_disk(disk_block_index);
+    // read a block from buffer cache
+    // on failure, keep the copy in memory rather than fill it with garbage
+    int ret = cache_read(disk_block_index, data);
+    if (ret == 0) {
+        printf("Error: exceed!\n");
+        return;
+    }
 
     // write data to corresponding space
     switch (fg) {
         case 0:     // super block
-            memcpy(&super_block, disk_buffer, 4 * 5);
+            memcpy(&super_block, data, 4 * 10);
             break;
         case 1:     // inode bitmap
-            memcpy(inode_bitmap.i_valid_bit, disk_buffer, 128);
+            memcpy(inode_bitmap.bits + index * BLOCK_SIZE, data, BLOCK_SIZE);
             break;
         case 2:     // block bitmap
-            memcpy(block_bitmap.b_valid_bit, disk_buffer, 256);
-            break;
-        case 3:     // inode
-            // already subtract inode index by 4, do not need to subtract
-            memcpy(&inode[index * 4], disk_buffer, 64);
-            memcpy(&inode[index * 4 + 1], disk_buffer + 64, 64);
-            memcpy(&inode[index * 4 + 2], disk_buffer + 128, 64);
-            memcpy(&inode[index * 4 + 3], disk_buffer + 192, 64);
-            break;
-        case 4:     // block
-            memcpy(&block[index], disk_buffer, 256);
-    }
-    if (ret == 0) {
-        printf("Error: exceed!\n");
+            memcpy(block_bitmap.bits + index * BLOCK_SIZE, data, BLOCK_SIZE);
     }
 }
 
-// Get cylinders and sectors_pc.
+// Get cylinders and sectors_pc, and decide the layout for formatting.
 void get_disk_org() {
     if (!SOCKET_OPEN) {
         cylinders = 64;
         sectors_pc = 128;
         disk_block_num = cylinders * sectors_pc;
+        set_layout();
         return;
     }
-    bzero(disk_buffer_w, MAX_LEN);  // clear buffer
-    int i = 0;
+    __u32 org[2];   // cylinders and sectors_pc
+    disk_call(DISK_OP_INFO, 0, 1, NULL, 0, (char *) org, sizeof(org));
+    cylinders = org[0];
+    sectors_pc = org[1];
 
-    // write 'I' to disk.c
-    sprintf(disk_buffer_w, "I");
-    client_write(1);
+    disk_block_num = cylinders * sectors_pc;
+    set_layout();
+}
 
-    // read data from disk.c
-    client_read();
-    while (disk_buffer[i] != ' ') {
-        i++;
-    }
-    disk_buffer[i] = '\0';
-    cylinders = atoi(disk_buffer);
-    disk_buffer[i] = ' ';
-    strcpy(disk_buffer, disk_buffer + i + 1);
-    sectors_pc = atoi(disk_buffer);
+// Read the w-th 64-bit word of a bitmap.
+// Bit j of the word is the (w * 64 + j)-th bit of the bitmap.
+__u64 read_word(__u8 data[], int w) {
+    __u64 bits;
+    memcpy(&bits, data + w * 8, 8);     // little endian, same as disk
+    return bits;
+}
 
-    bzero(disk_buffer, MAX_LEN);    // clear buffer
+// Allocate a bitmap of 'num' bits, all of which are free,
+//      in cylinder groups of 'group_bits' bits.
+void init_bitmap(struct bitmap *bm, int num, int group_bits) {
+    int regions = (num + 64 * REGION_WORDS - 1) / (64 * REGION_WORDS);
+    if (group_bits <= 0)    // no layout yet
+        group_bits = num > 0 ? num : 1;
+    int groups = (num + group_bits - 1) / group_bits;
+    free(bm->bits);
+    free(bm->dirty);
+    free(bm->region_free);
+    free(bm->group_free);
+    bm->num = num;
+    bm->num_block = (num + BITS_PER_BLOCK - 1) / BITS_PER_BLOCK;
+    bm->bits = (__u8 *) calloc(bm->num_block, BLOCK_SIZE);
+    bm->dirty = (__u8 *) calloc(bm->num_block, 1);
+    bm->region_free = (int *) calloc(regions, sizeof(int));
+    bm->group_bits = group_bits;
+    bm->group_free = (int *) calloc(groups + 1, sizeof(int));
+    if (bm->bits == NULL || bm->dirty == NULL || bm->region_free == NULL ||
+            bm->group_free == NULL) {
+        printf("Error: Could not allocate bitmap.\n");
+        exit(-1);
+    }
+}
 
-    disk_block_num = cylinders * sectors_pc;
+// Count free bits of a bitmap from bit 'start' to bit 'end' - 1, 64 bits at a time.
+int count_free(struct bitmap *bm, int start, int end) {
+    int count = 0;
+    for (int w = start / 64; w * 64 < end; w++) {
+        __u64 bits = ~read_word(bm->bits, w);
+        if (w * 64 < start)
+            bits &= ~0ULL << (start - w * 64);
+        if (end - w * 64 < 64)
+            bits &= ~(~0ULL << (end - w * 64));
+        count += __builtin_popcountll(bits);
+    }
+    return count;
+}
 
-    if (disk_block_num >= 3600)
-        INODE_NUM = 1024;
-    else
-        INODE_NUM = disk_block_num / 3 - 2;
-    BLOCK_NUM = 2 * INODE_NUM;
+// Count free bits of each region and each cylinder group of a bitmap.
+void init_summary(struct bitmap *bm) {
+    int words = (bm->num + 63) / 64;
+    int regions = (words + REGION_WORDS - 1) / REGION_WORDS;
+    memset(bm->region_free, 0, regions * sizeof(int));
+    for (int w = 0; w < words; w++) {
+        __u64 bits = read_word(bm->bits, w);
+        if (bm->num - w * 64 < 64)      // bits out of range are not free
+            bits = bits | (~0ULL << (bm->num - w * 64));
+        bm->region_free[w / REGION_WORDS] += 64 - __builtin_popcountll(bits);
+    }
+    for (int start = 0; start < bm->num; start += bm->group_bits) {
+        int end = start + bm->group_bits;
+        if (end > bm->num)
+            end = bm->num;
+        bm->group_free[start / bm->group_bits] = count_free(bm, start, end);
+    }
 }
 
 // Initialize super block.
@@ -404,36 +1198,126 @@ void init_super_block() {
     super_block.s_count_free_inode = INODE_NUM;
     super_block.s_count_free_block = BLOCK_NUM;
     super_block.s_inode_root = 0;
-    write_disk(0, 0);
+    super_block.s_magic = FS_MAGIC;
+    super_block.s_version = FS_VERSION;
+    super_block.s_cg_num = cg_num;
+    super_block.s_cg_inode_block = cg_inode_block;
+    super_block.s_cg_block = cg_block;
+    super_block_dirty = 1;
 }
 
 // Initialize inode bitmap.
 void init_inode_bitmap() {
-    for (int i = 0; i < 128; i++)
-        inode_bitmap.i_valid_bit[i] = 0;
-    write_disk(1, 0);
+    init_bitmap(&inode_bitmap, INODE_NUM, cg_inode_block * INODE_PER_BLOCK);
+    init_summary(&inode_bitmap);
+    memset(inode_bitmap.dirty, 1, inode_bitmap.num_block);
 }
 
 // Initialize block bitmap.
 void init_block_bitmap() {
-    for (int i = 0; i < 256; i++)
-        block_bitmap.b_valid_bit[i] = 0;
-    write_disk(2, 0);
+    init_bitmap(&block_bitmap, BLOCK_NUM, cg_block);
+    init_summary(&block_bitmap);
+    memset(block_bitmap.dirty, 1, block_bitmap.num_block);
 }
 
-// Initialize block.
-void init_block() {
-    for (int i = 0; i < BLOCK_NUM; i++)
-        for (int j = 0; j < BLOCK_SIZE; j++)
-            block[i].b_data[j] = '\0';
+// Drop inodes and extent maps in memory.
+// They may belong to the layout before formatting.
+void init_memory() {
+    inode_cache_reset();
+    bzero(extent_map, sizeof(extent_map));
+}
+
+// Load super block and bitmaps. They stay in memory afterwards.
+void meta_load() {
+    read_disk(0, 0);
+
+    // a disk not formatted by this version is regarded as unformatted
+    if (super_block.s_magic != FS_MAGIC || super_block.s_version != FS_VERSION) {
+        init_bitmap(&inode_bitmap, INODE_NUM, cg_inode_block * INODE_PER_BLOCK);
+        init_bitmap(&block_bitmap, BLOCK_NUM, cg_block);
+        read_disk(1, 0);    // inode bitmap starts at block 1 in every version
+        if ((inode_bitmap.bits[0] & 0b00000001) == 1)
+            printf("Disk format is not supported, please format it again.\n");
+        bzero(&super_block, sizeof(super_block));
+        bzero(inode_bitmap.bits, inode_bitmap.num_block * BLOCK_SIZE);
+    } else {
+        set_cylinder_group(super_block.s_cg_num, super_block.s_cg_inode_block,
+                           super_block.s_cg_block);
+        init_bitmap(&inode_bitmap, INODE_NUM, cg_inode_block * INODE_PER_BLOCK);
+        init_bitmap(&block_bitmap, BLOCK_NUM, cg_block);
+        for (int i = 0; i < inode_bitmap.num_block; i++)
+            read_disk(1, i);
+        for (int i = 0; i < block_bitmap.num_block; i++)
+            read_disk(2, i);
+    }
+    init_summary(&inode_bitmap);
+    init_summary(&block_bitmap);
+    super_block_dirty = 0;
+    time(&meta_flush_time);
+}
+
+// Write dirty super block and bitmap blocks to buffer cache.
+// If fg == 0, only write when 'meta_flush_interval' has passed.
+void meta_flush(int fg) {
+    time_t cur_timer;
+    time(&cur_timer);
+    if (fg == 0 && cur_timer - meta_flush_time < meta_flush_interval)
+        return;
+    if (super_block_dirty)
+        write_disk(0, 0);
+    for (int i = 0; i < inode_bitmap.num_block; i++)
+        if (inode_bitmap.dirty[i])
+            write_disk(1, i);
+    for (int i = 0; i < block_bitmap.num_block; i++)
+        if (block_bitmap.dirty[i])
+            write_disk(2, i);
+    super_block_dirty = 0;
+    memset(inode_bitmap.dirty, 0, inode_bitmap.num_block);
+    memset(block_bitmap.dirty, 0, block_bitmap.num_block);
+    meta_flush_time = cur_timer;
+}
+
+// Return: 1 if super block or any bitmap block is newer than disk, 0 if not.
+int meta_dirty() {
+    if (super_block_dirty)
+        return 1;
+    for (int i = 0; i < inode_bitmap.num_block; i++)
+        if (inode_bitmap.dirty[i])
+            return 1;
+    for (int i = 0; i < block_bitmap.num_block; i++)
+        if (block_bitmap.dirty[i])
+            return 1;
+    return 0;
+}
+
+// Wait until client.c sends the next command.
+// Dirty super block and bitmaps are written to disk once
+//      'meta_flush_interval' passes meanwhile, so that they are never
+//      older on disk than the interval, even if no command comes.
+void meta_flush_wait() {
+    while (meta_flush_interval > 0 && meta_dirty()) {
+        time_t cur_timer;
+        time(&cur_timer);
+        long timeout = (long) (meta_flush_time + meta_flush_interval - cur_timer) * 1000;
+        struct pollfd pfd = {client_newsockfd, POLLIN, 0};
+        int n = poll(&pfd, 1, timeout > 0 ? timeout : 0);
+        if (n < 0 && errno != EINTR) {
+            printf("Error: polling socket.\n");
+            exit(-1);
+        }
+        if (n > 0)
+            return;
+        if (n == 0) {
+            meta_flush(0);
+            cache_flush();
+        }
+    }
 }
 
 // Modify super block.
 // fg = 0: modify inode number.
 // fg = 1: modify block number.
 int modify_super_block(int fg, int modify_count) {
-    read_disk(0, 0);
-
     if (fg == 0) {  // update inode number
         int count_free_inode = super_block.s_count_free_inode;
         count_free_inode -= modify_count;
@@ -449,155 +1333,119 @@ int modify_super_block(int fg, int modify_count) {
         super_block.s_count_block += modify_count;
         super_block.s_count_free_block = count_free_block;
     }
-    write_disk(0, 0);
+    super_block_dirty = 1;
     return 1;
 }
 
 // Modify a bit of a __u8 to 0 or 1.
 // 'digit' (0 ~ 7) indicates the location of bit.
 __u8 modify_bitmap(__u8 bits, int digit, int valid_bit) {
-    if (valid_bit == 0) {
-        switch (digit) {
-            case 0:
-                bits = bits & 0b11111110;
-                break;
-            case 1:
-                bits = bits & 0b11111101;
-                break;
-            case 2:
-                bits = bits & 0b11111011;
-                break;
-            case 3:
-                bits = bits & 0b11110111;
-                break;
-            case 4:
-                bits = bits & 0b11101111;
-                break;
-            case 5:
-                bits = bits & 0b11011111;
-                break;
-            case 6:
-                bits = bits & 0b10111111;
-                break;
-            case 7:
-                bits = bits & 0b01111111;
-        }
-    }
-    if (valid_bit == 1) {
-        switch (digit) {
-            case 0:
-                bits = bits | 0b00000001;
-                break;
-            case 1:
-                bits = bits | 0b00000010;
-                break;
-            case 2:
-                bits = bits | 0b00000100;
-                break;
-            case 3:
-                bits = bits | 0b00001000;
-                break;
-            case 4:
-                bits = bits | 0b00010000;
-                break;
-            case 5:
-                bits = bits | 0b00100000;
-                break;
-            case 6:
-                bits = bits | 0b01000000;
-                break;
-            case 7:
-                bits = bits | 0b10000000;
-        }
-    }
+    if (valid_bit == 0)
+        bits = bits & ~(1 << digit);
+    if (valid_bit == 1)
+        bits = bits | (1 << digit);
     return bits;
 }
 
+// Check the digit-th bit of 'bits' is 1 or 0.
+// If 1, return 1, 2, 4, 8, 16, 32, 64, 128.
+// If 0, return 0.
+int __check_valid(__u8 bits, int digit) {
+    return bits & (1 << digit);
+}
+
+// Modify bit 'index' of a bitmap to 0 or 1. (Internal function)
+void __modify_bitmap(struct bitmap *bm, int index, int valid_bit) {
+    int i = index / 8;
+    int digit = index % 8;
+    if ((__check_valid(bm->bits[i], digit) != 0) != valid_bit) {
+        bm->region_free[index / 64 / REGION_WORDS] += valid_bit ? -1 : 1;
+        bm->group_free[index / bm->group_bits] += valid_bit ? -1 : 1;
+    }
+    bm->bits[i] = modify_bitmap(bm->bits[i], digit, valid_bit);
+    bm->dirty[index / BITS_PER_BLOCK] = 1;
+}
+
 // Modify inode bitmap and super block.
 void modify_inode_bitmap(int i_index, int i_valid_bit) {
-    read_disk(1, 0);
-
-    int i = i_index / 8;
-    int digit = i_index % 8;
     if (i_valid_bit == 1)
         modify_super_block(0, 1);
     else
         modify_super_block(0, -1);
-    inode_bitmap.i_valid_bit[i] = modify_bitmap(inode_bitmap.i_valid_bit[i],
-                                                digit, i_valid_bit);
-
-    write_disk(1, 0);
+    __modify_bitmap(&inode_bitmap, i_index, i_valid_bit);
 }
 
 // Modify block bitmap and super block.
 void modify_block_bitmap(int b_index, int b_valid_bit) {
-    read_disk(2, 0);
-
-    int i = b_index / 8;
-    int digit = b_index - i;
     if (b_valid_bit == 1)
         modify_super_block(1, 1);
     else
         modify_super_block(1, -1);
-    block_bitmap.b_valid_bit[i] = modify_bitmap(block_bitmap.b_valid_bit[i],
-                                                digit, b_valid_bit);
-
-    write_disk(2, 0);
-}
-
-// Convert an inode index (__u16) to a string.
-void itoa_2(__u16 i_index, char i_index_ch[2]) {
-    i_index_ch[0] = (char) (i_index % (1 << 8));
-    i_index_ch[1] = (char) (i_index / (1 << 8));
-}
-
-// Convert a string to an inode index (__u16).
-__u16 atoi_2(char i_index_ch[2]) {
-    __u16 i_index;
-    i_index = ((__u16) i_index_ch[0]) & 0x00ff;     // must & 0x00ff
-    i_index += ((__u16) i_index_ch[1]) * (1 << 8);
-    return i_index;
+    __modify_bitmap(&block_bitmap, b_index, b_valid_bit);
 }
 
 // Clear given inode's access time with 0.
 // That is because function 'build_inode'
 //      will set all the information to 0
 //      except access time of this inode.
-void clear_inode(__u16 free_inode_index) {
+void clear_inode(__u32 free_inode_index) {
     read_disk(3, free_inode_index);
 
-    inode[free_inode_index].i_time_access = 0;
+    get_inode(free_inode_index)->i_time_access = 0;
 
     write_disk(3, free_inode_index);
 }
 
 // Clear given block with '\0'.
-void clear_block(__u16 free_block_index) {
-    for (int i = 0; i < 256; i++)
-        block[free_block_index].b_data[i] = '\0';
-
-    write_disk(4, free_block_index);
-}
-
-// Find the first 0 of a binary number.
-// length: 128 --> inode bitmap, 256 --> block bitmap
-__u16 __find_free(__u8 data[], int length) {
-    __u8 detection;
-    for (int i = 0; i < length; i++) {
-        detection = 0b00000001;
-        for (int j = 0; j < 8; j++) {
-            if ((detection & data[i]) == 0)
-                return (i * 8 + j);
-            detection = detection << 1;
+void clear_block(__u32 free_block_index) {
+    char data[BLOCK_SIZE];
+    bzero(data, BLOCK_SIZE);
+
+    write_block(free_block_index, data);
+}
+
+// Find a free bit of a bitmap from bit 'goal', 64 bits at a time.
+// Search wraps around at the end of bitmap,
+//      and regions without free bits are skipped.
+// If not found, return -1.
+int __find_free(struct bitmap *bm, int goal) {
+    int words = (bm->num + 63) / 64;
+    if (goal < 0 || goal >= bm->num)
+        goal = 0;
+    int w = goal / 64;
+    __u64 mask = ~0ULL << (goal % 64);  // skip bits before goal at first
+    int k = 0;      // number of words searched
+    while (k <= words) {
+        int region = w / REGION_WORDS;
+        if (bm->region_free[region] == 0) {
+            // skip the rest of this region
+            int next = (region + 1) * REGION_WORDS;
+            if (next > words)
+                next = words;
+            k += next - w;
+            w = next % words;
+            mask = ~0ULL;
+            continue;
         }
+        __u64 bits = ~read_word(bm->bits, w) & mask;
+        mask = ~0ULL;
+        if (bits != 0) {
+            int index = w * 64 + __builtin_ctzll(bits);
+            if (index < bm->num)
+                return index;
+        }
+        k++;
+        w = (w + 1) % words;
     }
+    return -1;
 }
 
-// Find a free inode index by inode bitmap.
-__u16 find_free_inode() {
-    read_disk(1, 0);
-
-    __u16 free_inode_index = __find_free(inode_bitmap.i_valid_bit, 128);
+// Find a free inode index by inode bitmap, searching from inode 'goal'.
+// If there is none, return NO_FREE.
+__u32 find_free_inode(int goal) {
+    int free_inode_index = __find_free(&inode_bitmap, goal);
+    if (free_inode_index < 0)
+        return NO_FREE;
 
     modify_inode_bitmap(free_inode_index, 1);
 
@@ -605,194 +1453,654 @@ __u16 find_free_inode() {
     return free_inode_index;
 }
 
-// Find a free block index by block bitmap.
+// Find a free block index by block bitmap, searching from block 'goal'.
 // Clear this block with '\0'.
-__u16 find_free_block() {
-    read_disk(2, 0);
-
-    __u16 free_block_index = __find_free(block_bitmap.b_valid_bit, 256);
+// If there is none, return NO_FREE.
+__u32 find_free_block(int goal) {
+    int free_block_index = __find_free(&block_bitmap, goal);
+    if (free_block_index < 0)
+        return NO_FREE;
     modify_block_bitmap(free_block_index, 1);
     clear_block(free_block_index);
     return free_block_index;
 }
 
-// Check the digit-th bit of 'bits' is 1 or 0.
-// If 1, return 1, 2, 4, 8, 16, 32, 64, 128.
-// If 0, return 0.
-int __check_valid(__u8 bits, int digit) {
-    switch (digit) {
-        case 0:
-            return bits & 0b00000001;
-        case 1:
-            return bits & 0b00000010;
-        case 2:
-            return bits & 0b00000100;
-        case 3:
-            return bits & 0b00001000;
-        case 4:
-            return bits & 0b00010000;
-        case 5:
-            return bits & 0b00100000;
-        case 6:
-            return bits & 0b01000000;
-        case 7:
-            return bits & 0b10000000;
+// Check 'num_block_add' data blocks can be added to a file,
+//      after 'num_block_freed' blocks of it are deleted.
+// The extent nodes mapping them are counted as well, and RESERVE_BLOCK
+//      blocks are left, so the nodes added without a check never run out.
+// If they can, return 1.
+// Otherwise, return 0.
+int check_free_block(int num_block_add, int num_block_freed) {
+    long need = num_block_add + num_block_add / (EXTENT_NODE_NUM - 1) + RESERVE_BLOCK;
+    return need <= (long) super_block.s_count_free_block + num_block_freed;
+}
+
+// If the inode is valid, return value > 0.
+// Otherwise, return 0.
+int check_valid_inode(__u32 i_index) {
+    int digit = i_index % 8;
+    __u8 bits = inode_bitmap.bits[i_index / 8];
+    return __check_valid(bits, digit);
+}
+
+// If the block is valid, return value > 0.
+// Otherwise, return 0.
+int check_valid_block(__u32 b_index) {
+    int digit = b_index % 8;
+    __u8 bits = block_bitmap.bits[b_index / 8];
+    return __check_valid(bits, digit);
+}
+
+// Count free inodes and free blocks of cylinder group 'g'.
+void count_group_free(int g, int *free_inode, int *free_block) {
+    *free_inode = inode_bitmap.group_free[g];
+    *free_block = block_bitmap.group_free[g];
+}
+
+// Choose a cylinder group for a new directory in directory 'parent'.
+// It stays in the group of parent while that group has free inodes and
+//      at least half of the average free blocks. Otherwise, like FFS, it
+//      goes to the group with the most free blocks among those with free
+//      inodes.
+// Return: the first inode of the group.
+int find_dir_group(__u32 parent) {
+    int g = parent / (cg_inode_block * INODE_PER_BLOCK);
+    int free_inode, free_block;
+    count_group_free(g, &free_inode, &free_block);
+    if (free_inode > 0 && free_block * cg_num * 2 >= (int) super_block.s_count_free_block)
+        return g * cg_inode_block * INODE_PER_BLOCK;
+
+    int best = g, best_free = -1;
+    for (g = 0; g < cg_num; g++) {
+        count_group_free(g, &free_inode, &free_block);
+        if (free_inode > 0 && free_block > best_free) {
+            best = g;
+            best_free = free_block;
+        }
+    }
+    return best * cg_inode_block * INODE_PER_BLOCK;
+}
+
+// Update time. (Internal function)
+void __update_time(__u32 *_time) {
+    time_t cur_timer;
+    time(&cur_timer);
+    struct tm *cur_time = localtime(&cur_timer);
+    int year = cur_time->tm_year + 1900;
+    int mon = cur_time->tm_mon + 1;
+    int mday = cur_time->tm_mday;
+    int hour = (cur_time->tm_hour + 15) % 24;   // Correct hour.
+    int min = cur_time->tm_min;
+    int sec = cur_time->tm_sec;
+
+    mon = mon << 6;
+    mday = mday << 10;
+    hour = hour << 15;
+    min = min << 20;
+    sec = sec << 26;
+    *_time = year - 2000 + mon + mday + hour + min + sec;
+}
+
+// Update time.
+// fg = 1: access time
+// fg = 2: modify time
+// fg = 3: change time
+void update_time(int fg, __u32 i_index) {
+    read_disk(3, i_index);
+
+    switch (fg) {
+        case 0:     // access time
+            __update_time(&get_inode(i_index)->i_time_access);
+            break;
+        case 1:     // modify time
+            __update_time(&get_inode(i_index)->i_time_modify);
+            break;
+        case 2:     // inode change time
+            __update_time(&get_inode(i_index)->i_time_change);
+    }
+
+    write_disk(3, i_index);
+}
+
+// Update time. This will modify all the parent inode.
+void update_time_total(int fg, __u32 i_index) {
+    while (i_index != 0) {
+        update_time(fg, i_index);
+        // do not need to read disk because update_time read already
+        i_index = get_inode(i_index)->i_inode_parent_dir;
+    }
+    update_time(fg, i_index);
+}
+
+// Read the root of extent tree of inode 'i_index' to 'node'.
+void read_extent_root(__u32 i_index, struct extent_node *node) {
+    read_disk(3, i_index);
+    bzero(node, sizeof(*node));
+    node->count = get_inode(i_index)->i_extent_num;
+    node->level = get_inode(i_index)->i_extent_depth;
+    memcpy(node->entry, get_inode(i_index)->i_extent, sizeof(get_inode(i_index)->i_extent));
+}
+
+// Write the root of extent tree of inode 'i_index' from 'node'.
+void write_extent_root(__u32 i_index, struct extent_node *node) {
+    read_disk(3, i_index);
+    get_inode(i_index)->i_extent_num = node->count;
+    get_inode(i_index)->i_extent_depth = node->level;
+    memcpy(get_inode(i_index)->i_extent, node->entry, sizeof(get_inode(i_index)->i_extent));
+    write_disk(3, i_index);
+}
+
+// Read an extent node from block 'b_index'.
+void read_extent_node(__u32 b_index, struct extent_node *node) {
+    read_block(b_index, (char *) node);
+}
+
+// Write an extent node to block 'b_index'.
+void write_extent_node(__u32 b_index, struct extent_node *node) {
+    write_block(b_index, (char *) node);
+}
+
+// Forget the memoized leaf of inode 'i_index'.
+void invalidate_extent_map(__u32 i_index) {
+    struct extent_map *map = &extent_map[i_index % EXTENT_MAP_SIZE];
+    if (map->i_index == i_index)
+        map->valid = 0;
+}
+
+// Walk the extent tree of inode 'i_index' down to the leaf which maps
+//      virtual block 'b_index_v', and memoize the leaf in 'extent_map'.
+void load_extent_map(__u32 i_index, __u32 b_index_v) {
+    struct extent_map *map = &extent_map[i_index % EXTENT_MAP_SIZE];
+    struct extent_node *node = &map->leaf;
+    __u32 v_start = 0;
+    read_extent_root(i_index, node);
+
+    while (node->level > 0) {
+        int i = 0;
+        while (i + 1 < node->count && b_index_v - v_start >= node->entry[i].e_len) {
+            v_start += node->entry[i].e_len;
+            i++;
+        }
+        read_extent_node(node->entry[i].e_start, node);
+    }
+
+    map->valid = 1;
+    map->i_index = i_index;
+    map->v_start = v_start;
+    map->v_len = 0;
+    for (int i = 0; i < node->count; i++)
+        map->v_len += node->entry[i].e_len;
+}
+
+// Convert virtual block index to physical block index.
+// Virtual block index: 0, 1, 2, ...
+// The tree is only walked when the block is out of the memoized leaf.
+__u32 find_block_index(__u32 i_index, __u32 b_index_v) {
+    struct extent_map *map = &extent_map[i_index % EXTENT_MAP_SIZE];
+    if (map->valid && map->i_index == i_index && b_index_v >= map->v_start && b_index_v - map->v_start < map->v_len) {
+        extent_map_hit++;
+    } else {
+        extent_map_miss++;
+        load_extent_map(i_index, b_index_v);
+    }
+
+    struct extent_node *node = &map->leaf;
+    int i = 0;
+    b_index_v -= map->v_start;
+    while (i + 1 < node->count && b_index_v >= node->entry[i].e_len) {
+        b_index_v -= node->entry[i].e_len;
+        i++;
+    }
+    return node->entry[i].e_start + b_index_v;
+}
+
+// Create extent nodes from 'level' down to leaf, which map block 'b_index'.
+// Return: the block of the new node at 'level'.
+__u32 new_extent_path(int level, __u32 b_index) {
+    struct extent_node node;
+    bzero(&node, sizeof(node));
+    node.count = 1;
+    node.level = level;
+    node.entry[0].e_start = level == 0 ? b_index : new_extent_path(level - 1, b_index);
+    node.entry[0].e_len = 1;
+
+    __u32 b_node = find_free_block(block_group_block(b_index));
+    write_extent_node(b_node, &node);
+    return b_node;
+}
+
+// Append block 'b_index' to the end of 'node'. (Internal function)
+// max: the maximum number of entries in 'node'.
+// If appended, return 1.
+// If the sub-tree of 'node' is full, return 0.
+int __append_extent(struct extent_node *node, int max, __u32 b_index) {
+    if (node->count > 0) {
+        struct extent *last = &node->entry[node->count - 1];
+        if (node->level == 0) {
+            // extend the last extent
+            if (last->e_start + last->e_len == b_index && last->e_len < 0xffffffff) {
+                last->e_len++;
+                return 1;
+            }
+        } else {
+            struct extent_node child;
+            read_extent_node(last->e_start, &child);
+            if (__append_extent(&child, EXTENT_NODE_NUM, b_index)) {
+                write_extent_node(last->e_start, &child);
+                last->e_len++;
+                return 1;
+            }
+        }
+    }
+    if (node->count == max)
+        return 0;
+
+    // add a new extent or a new child
+    struct extent *e = &node->entry[node->count];
+    e->e_start = node->level == 0 ? b_index : new_extent_path(node->level - 1, b_index);
+    e->e_len = 1;
+    node->count++;
+    return 1;
+}
+
+// Append block 'b_index' to the end of file 'i_index'.
+void append_extent(__u32 i_index, __u32 b_index) {
+    struct extent_node root;
+    read_extent_root(i_index, &root);
+    invalidate_extent_map(i_index);
+
+    if (!__append_extent(&root, EXTENT_ROOT_NUM, b_index)) {
+        // tree is full: move the root to a new block,
+        //      and the root in inode points to it.
+        __u32 b_node = find_free_block(block_group_block(b_index));
+        __u32 len = 0;
+        for (int i = 0; i < root.count; i++)
+            len += root.entry[i].e_len;
+        write_extent_node(b_node, &root);
+
+        root.level++;
+        root.count = 1;
+        root.entry[0].e_start = b_node;
+        root.entry[0].e_len = len;
+        __append_extent(&root, EXTENT_ROOT_NUM, b_index);
+    }
+    write_extent_root(i_index, &root);
+}
+
+// Delete the blocks mapped by 'node' except the first 'keep' ones,
+//      and the extent nodes which become empty. (Internal function)
+void __truncate_extent(struct extent_node *node, int keep) {
+    int count = 0;
+    for (int i = 0; i < node->count; i++) {
+        struct extent *e = &node->entry[i];
+        int k = keep < e->e_len ? keep : e->e_len;  // kept blocks of this entry
+        keep -= k;
+        if (k < e->e_len) {
+            if (node->level == 0) {
+                for (int j = k; j < e->e_len; j++)
+                    modify_block_bitmap(e->e_start + j, 0);
+            } else {
+                struct extent_node child;
+                read_extent_node(e->e_start, &child);
+                __truncate_extent(&child, k);
+                if (k == 0)
+                    modify_block_bitmap(e->e_start, 0);
+                else
+                    write_extent_node(e->e_start, &child);
+            }
+            e->e_len = k;
+        }
+        if (k > 0)
+            count++;
+    }
+    node->count = count;
+}
+
+// Keep the first 'keep' blocks of file 'i_index', and delete the others.
+void truncate_extent(__u32 i_index, int keep) {
+    struct extent_node root;
+    read_extent_root(i_index, &root);
+    invalidate_extent_map(i_index);
+    __truncate_extent(&root, keep);
+    if (root.count == 0)
+        root.level = 0;
+    write_extent_root(i_index, &root);
+}
+
+// Return: the number of blocks read by 'prefetch_block' at a time.
+// Half of buffer cache is left for the blocks in use.
+int prefetch_window() {
+    int window = cache_size / 2;
+    if (window > DISK_MAX_COUNT)
+        window = DISK_MAX_COUNT;
+    if (window < 1)
+        window = 1;
+    return window;
+}
+
+// Read virtual blocks 'first' ~ 'last' of file 'i_index' to buffer cache
+//      by one request to disk.c, at most 'prefetch_window()' blocks.
+// Callers walking a long range call it again at every window.
+void prefetch_block(__u32 i_index, int first, int last) {
+    if (!SOCKET_OPEN)
+        return;
+    int index[DISK_MAX_COUNT];
+    int n = 0;
+    if (last - first + 1 > prefetch_window())
+        last = first + prefetch_window() - 1;
+    for (int i = first; i <= last; i++)
+        index[n++] = data_disk_block(find_block_index(i_index, i));
+    cache_prefetch(index, n);
+}
+
+// Read virtual block 'b_index_v' of directory 'i_index' to 'data'.
+void read_dir_block(__u32 i_index, __u32 b_index_v, char data[BLOCK_SIZE]) {
+    __u32 b_index = find_block_index(i_index, b_index_v);
+    read_block(b_index, data);
+}
+
+// Write 'data' to virtual block 'b_index_v' of directory 'i_index'.
+void write_dir_block(__u32 i_index, __u32 b_index_v, char data[BLOCK_SIZE]) {
+    __u32 b_index = find_block_index(i_index, b_index_v);
+    write_block(b_index, data);
+}
+
+// Build a directory entry.
+void build_dir_entry(struct dir_entry *entry, __u32 i_index, __u8 type, const char name[16]) {
+    entry->d_inode = i_index;
+    entry->d_type = type;
+    entry->d_name_len = strnlen(name, 15);
+    memcpy(entry->d_name, name, entry->d_name_len);
+    entry->d_name[entry->d_name_len] = '\0';
+}
+
+// Get the entry at 'pos' of a directory block.
+// Return: the length of the entry, or 0 if there are no more entries.
+int get_dir_entry(char data[BLOCK_SIZE], int pos, struct dir_entry *entry) {
+    if (pos + DIR_ENTRY_HEAD > BLOCK_SIZE)
+        return 0;
+    memcpy(entry, data + pos, DIR_ENTRY_HEAD);
+    if (entry->d_name_len == 0)
+        return 0;
+    memcpy(entry->d_name, data + pos + DIR_ENTRY_HEAD, entry->d_name_len);
+    entry->d_name[entry->d_name_len] = '\0';
+    return DIR_ENTRY_HEAD + entry->d_name_len;
+}
+
+// Put 'entry' at 'pos' of a directory block.
+void put_dir_entry(char data[BLOCK_SIZE], int pos, struct dir_entry *entry) {
+    memcpy(data + pos, entry, DIR_ENTRY_HEAD);
+    memcpy(data + pos + DIR_ENTRY_HEAD, entry->d_name, entry->d_name_len);
+}
+
+// Find 'name' in a directory block.
+// If find it, store its entry and return its position.
+// Otherwise, return -1.
+int find_entry_in_block(char data[BLOCK_SIZE], const char name[16], struct dir_entry *entry) {
+    int pos = 0, len;
+    while ((len = get_dir_entry(data, pos, entry)) > 0) {
+        if (strcmp(name, entry->d_name) == 0)
+            return pos;
+        pos += len;
+    }
+    return -1;
+}
+
+// Return: the used bytes of a directory block.
+int dir_block_used(char data[BLOCK_SIZE]) {
+    struct dir_entry entry;
+    int pos = 0, len;
+    while ((len = get_dir_entry(data, pos, &entry)) > 0)
+        pos += len;
+    return pos;
+}
+
+// Hash of a file / dir name. (FNV-1a)
+__u32 hash_name(const char name[16]) {
+    __u32 hash = 2166136261u;
+    for (int i = 0; i < 16 && name[i] != '\0'; i++) {
+        hash ^= (__u8) name[i];
+        hash *= 16777619u;
     }
+    return hash;
 }
 
-// If the inode is valid, return value > 0.
-// Otherwise, return 0.
-int check_valid_inode(__u16 i_index) {
-    read_disk(1, 0);
-
-    int digit = i_index % 8;
-    __u8 bits = inode_bitmap.i_valid_bit[i_index / 8];
-    return __check_valid(bits, digit);
+// Read an index node from block 'b_index'.
+void read_index_node(__u32 b_index, struct index_node *node) {
+    read_block(b_index, (char *) node);
 }
 
-// If the block is valid, return value > 0.
-// Otherwise, return 0.
-int check_valid_block(__u16 b_index) {
-    read_disk(2, 0);
+// Write an index node to block 'b_index'.
+void write_index_node(__u32 b_index, struct index_node *node) {
+    write_block(b_index, (char *) node);
+}
 
-    int digit = b_index % 8;
-    __u8 bits = block_bitmap.b_valid_bit[b_index / 8];
-    return __check_valid(bits, digit);
+// Find the child of an internal node which may contain 'hash'.
+// Return: the location of the child in 'node'.
+int find_index_child(struct index_node *node, __u32 hash) {
+    int i = 0;
+    while (i + 1 < node->count && node->entry[i + 1].hash <= hash)
+        i++;
+    return i;
 }
 
-// Update time. (Internal function)
-void __update_time(__u32 *_time) {
-    time_t cur_timer;
-    time(&cur_timer);
-    struct tm *cur_time = localtime(&cur_timer);
-    int year = cur_time->tm_year + 1900;
-    int mon = cur_time->tm_mon + 1;
-    int mday = cur_time->tm_mday;
-    int hour = (cur_time->tm_hour + 15) % 24;   // Correct hour.
-    int min = cur_time->tm_min;
-    int sec = cur_time->tm_sec;
+// Create an empty hash index for directory 'i_index'.
+void create_dir_index(__u32 i_index) {
+    struct index_node node;
+    __u32 b_index = find_free_block(inode_group_block(i_index));
+    bzero(&node, sizeof(node));
+    write_index_node(b_index, &node);
 
-    mon = mon << 6;
-    mday = mday << 10;
-    hour = hour << 15;
-    min = min << 20;
-    sec = sec << 26;
-    *_time = year - 2000 + mon + mday + hour + min + sec;
+    read_disk(3, i_index);
+    get_inode(i_index)->i_dir_index = b_index;
+    write_disk(3, i_index);
 }
 
-// Update time.
-// fg = 1: access time
-// fg = 2: modify time
-// fg = 3: change time
-void update_time(int fg, __u16 i_index) {
-    read_disk(3, i_index);
+// Look up 'name' in the hash index of directory 'i_index'.
+// If find it, store its entry and the virtual block index of the entry,
+//      and return 1.
+// Otherwise, return 0.
+int lookup_dir_index(__u32 i_index, const char name[16], struct dir_entry *entry, int *b_index_v) {
+    struct index_node node;
+    char data[BLOCK_SIZE];
+    __u32 hash = hash_name(name);
 
-    switch (fg) {
-        case 0:     // access time
-            __update_time(&inode[i_index].i_time_access);
-            break;
-        case 1:     // modify time
-            __update_time(&inode[i_index].i_time_modify);
-            break;
-        case 2:     // inode change time
-            __update_time(&inode[i_index].i_time_change);
+    read_disk(3, i_index);
+    read_index_node(get_inode(i_index)->i_dir_index, &node);
+    while (node.level > 0)
+        read_index_node(node.entry[find_index_child(&node, hash)].value, &node);
+
+    // only the directory blocks which have the same hash are read
+    for (int i = 0; i < node.count; i++) {
+        if (node.entry[i].hash != hash)
+            continue;
+        read_dir_block(i_index, node.entry[i].value, data);
+        if (find_entry_in_block(data, name, entry) >= 0) {
+            *b_index_v = node.entry[i].value;
+            return 1;
+        }
     }
+    return 0;
+}
 
-    write_disk(3, i_index);
+// Insert an entry into a full node, and split the node into two.
+// 'b_index' keeps the lower half, and a new block gets the upper half.
+// Entries with the same hash are never split into two nodes.
+// If split, return 1 and store the new block in 'split'.
+// If all the entries have the same hash, return -1.
+int split_index_node(__u32 b_index, struct index_node *node, int loc,
+                     struct index_entry entry, struct index_entry *split) {
+    struct index_entry tmp[INDEX_ENTRY_NUM + 1];
+    struct index_node upper;
+    int total = INDEX_ENTRY_NUM + 1;
+
+    memcpy(tmp, node->entry, loc * sizeof(entry));
+    tmp[loc] = entry;
+    memcpy(tmp + loc + 1, node->entry + loc, (INDEX_ENTRY_NUM - loc) * sizeof(entry));
+
+    // find a location which separates different hashes, near the middle
+    int mid = -1;
+    for (int d = 0; d < total / 2 && mid < 0; d++) {
+        if (tmp[total / 2 + d - 1].hash != tmp[total / 2 + d].hash)
+            mid = total / 2 + d;
+        else if (tmp[total / 2 - d - 1].hash != tmp[total / 2 - d].hash)
+            mid = total / 2 - d;
+    }
+    if (mid < 0)
+        return -1;
+
+    bzero(&upper, sizeof(upper));
+    upper.level = node->level;
+    upper.count = total - mid;
+    memcpy(upper.entry, tmp + mid, upper.count * sizeof(entry));
+    node->count = mid;
+    memcpy(node->entry, tmp, mid * sizeof(entry));
+
+    split->hash = tmp[mid].hash;
+    split->value = find_free_block(block_group_block(b_index));
+    write_index_node(split->value, &upper);
+    write_index_node(b_index, node);
+    return 1;
 }
 
-// Update time. This will modify all the parent inode.
-void update_time_total(int fg, __u16 i_index) {
-    while (i_index != 0) {
-        update_time(fg, i_index);
-        // do not need to read disk because update_time read already
-        i_index = inode[i_index].i_inode_parent_dir;
+// Insert an entry into the sub-tree of block 'b_index'. (Internal function)
+// If inserted, return 0.
+// If the node is split, return 1 and store the new block in 'split'.
+// If failed, return -1.
+int __insert_dir_index(__u32 b_index, struct index_entry entry, struct index_entry *split) {
+    struct index_node node;
+    int loc;
+    read_index_node(b_index, &node);
+
+    if (node.level > 0) {
+        struct index_entry child_split;
+        int i = find_index_child(&node, entry.hash);
+        int ret = __insert_dir_index(node.entry[i].value, entry, &child_split);
+        if (ret <= 0)
+            return ret;
+        read_index_node(b_index, &node);
+        entry = child_split;    // add the new child after the i-th child
+        loc = i + 1;
+    } else {
+        loc = 0;                // keep leaf ordered by hash
+        while (loc < node.count && node.entry[loc].hash <= entry.hash)
+            loc++;
     }
-    update_time(fg, i_index);
+
+    if (node.count == INDEX_ENTRY_NUM)
+        return split_index_node(b_index, &node, loc, entry, split);
+
+    memmove(node.entry + loc + 1, node.entry + loc, (node.count - loc) * sizeof(entry));
+    node.entry[loc] = entry;
+    node.count++;
+    write_index_node(b_index, &node);
+    return 0;
 }
 
-// Find a free block.
-// Store the free block index to loc-th in given block 'b_index'.
-// loc: 0, 2, 4, ..., 254
-// Return: the newly found free block index.
-__u16 find_and_set(__u16 b_index, int loc) {
-    read_disk(4, b_index);
+// Insert 'name' (in virtual block 'b_index_v') into the hash index of directory 'i_index'.
+// If inserted, return 1.
+// Otherwise, return 0.
+int insert_dir_index(__u32 i_index, const char name[16], int b_index_v) {
+    struct index_entry entry, split;
+    struct index_node root;
 
-    __u16 b_index_new = find_free_block();
-    char b_index_ch[2];
-    itoa_2(b_index_new, b_index_ch);
-    block[b_index].b_data[loc] = b_index_ch[0];
-    block[b_index].b_data[loc + 1] = b_index_ch[1];
+    read_disk(3, i_index);
+    __u32 b_root = get_inode(i_index)->i_dir_index;
+    entry.hash = hash_name(name);
+    entry.value = b_index_v;
 
-    write_disk(4, b_index);
-    return b_index_new;
+    int ret = __insert_dir_index(b_root, entry, &split);
+    if (ret < 0)
+        return 0;
+    if (ret == 1) {
+        // root is split: move its lower half to a new block,
+        // so that the root block stays the same.
+        read_index_node(b_root, &root);
+        __u32 b_lower = find_free_block(block_group_block(b_root));
+        write_index_node(b_lower, &root);
+
+        root.level++;
+        root.count = 2;
+        root.entry[0].hash = 0;
+        root.entry[0].value = b_lower;
+        root.entry[1] = split;
+        write_index_node(b_root, &root);
+    }
+    return 1;
 }
 
-/// Find the index at the location 'loc' in given block.
-// Convert this string index to a __u16 index.
-// loc: 0, 2, 4, ..., 254
-// Return: the index in the 'loc' in given block.
-__u16 find_and_convert(__u16 b_index, int loc) {
-    read_disk(4, b_index);
+// Delete 'name' (in virtual block 'b_index_v') from the hash index of directory 'i_index'.
+// Empty leaves are kept.
+void delete_dir_index(__u32 i_index, const char name[16], int b_index_v) {
+    struct index_node node;
+    __u32 hash = hash_name(name);
 
-    char b_index_ch[2];
-    b_index_ch[0] = block[b_index].b_data[loc];
-    b_index_ch[1] = block[b_index].b_data[loc + 1];
-    return atoi_2(b_index_ch);
+    read_disk(3, i_index);
+    __u32 b_index = get_inode(i_index)->i_dir_index;
+    read_index_node(b_index, &node);
+    while (node.level > 0) {
+        b_index = node.entry[find_index_child(&node, hash)].value;
+        read_index_node(b_index, &node);
+    }
+
+    for (int i = 0; i < node.count; i++) {
+        if (node.entry[i].hash == hash && node.entry[i].value == b_index_v) {
+            node.count--;
+            memmove(node.entry + i, node.entry + i + 1, (node.count - i) * sizeof(node.entry[0]));
+            write_index_node(b_index, &node);
+            return;
+        }
+    }
 }
 
-// Convert virtual block index to physical block index.
-// Virtual block index: 0, 1, 2, ...
-__u16 find_block_index(__u16 i_index, __u16 b_index_v) {
+// Move 'name' from virtual block 'b_index_v' to 'new_b_index_v'
+//      in the hash index of directory 'i_index'.
+// Only the value of its leaf entry changes, so the leaf is never split.
+void move_dir_index(__u32 i_index, const char name[16], int b_index_v, int new_b_index_v) {
+    struct index_node node;
+    __u32 hash = hash_name(name);
+
     read_disk(3, i_index);
+    __u32 b_index = get_inode(i_index)->i_dir_index;
+    read_index_node(b_index, &node);
+    while (node.level > 0) {
+        b_index = node.entry[find_index_child(&node, hash)].value;
+        read_index_node(b_index, &node);
+    }
+
+    for (int i = 0; i < node.count; i++) {
+        if (node.entry[i].hash == hash && node.entry[i].value == b_index_v) {
+            node.entry[i].value = new_b_index_v;
+            write_index_node(b_index, &node);
+            return;
+        }
+    }
+}
 
-    if (b_index_v < 8) {    // direct block
-        return inode[i_index].i_block_direct[b_index_v];
-    } else if (b_index_v < 8 + 128) {   // single indirect block
-        int single_index_v = b_index_v - 8;   // 0 ~ 127
-        return find_and_convert(inode[i_index].i_block_single, single_index_v * 2);
-    } else if (b_index_v < 8 + 128 + 128 * 128) {   // double indirect block
-        int double_index_v = (b_index_v - 8 - 128) / 128;   // 0 ~ 127
-        int single_index_v = (b_index_v - 8 - 128) % 128;   // 0 ~ 127
-        __u16 single_index = find_and_convert(inode[i_index].i_block_double, double_index_v * 2);
-        return find_and_convert(single_index, single_index_v * 2);
-    } else if (b_index_v < 8 + 128 + 128 * 128 + 128 * 128 * 128) { // triple indirect block
-        int triple_index_v = (b_index_v - 8 - 128 - 128 * 128) / (128 * 128);   // 0 ~ 127
-        int double_index_v = (b_index_v - 8 - 128 - 128 * 128) / 128 % 128;     // 0 ~ 127
-        int single_index_v = (b_index_v - 8 - 128 - 128 * 128) % 128;           // 0 ~ 127
-        __u16 double_index = find_and_convert(inode[i_index].i_block_triple, triple_index_v * 2);
-        __u16 single_index = find_and_convert(double_index, double_index_v * 2);
-        return find_and_convert(single_index, single_index_v * 2);
-    }
-}
-
-// Convert virtual inode index to physical inode index. (directory file)
-// Virtual inode index: 0, 1, 2, ...
-__u16 find_inode_index(__u16 i_index, __u16 i_index_v) {
-    __u16 b_index_v = i_index_v / 128;
-    __u16 b_index = find_block_index(i_index, b_index_v);
-    return find_and_convert(b_index, (i_index_v % 128) * 2);
+// Free all the blocks of the sub-tree of block 'b_index'.
+void free_dir_index(__u32 b_index) {
+    struct index_node node;
+    read_index_node(b_index, &node);
+    if (node.level > 0)
+        for (int i = 0; i < node.count; i++)
+            free_dir_index(node.entry[i].value);
+    modify_block_bitmap(b_index, 0);
 }
 
 // Check the name is repeated or not in directory.
-// If find it, return virtual inode index.
+// If find it, return physical inode index.
 // Otherwise, return -1.
-int check_repeat(__u16 i_index, char name[16]) {
-    read_disk(3, i_index);
-
-    int size = inode[i_index].i_size_file;
-    __u16 i_index_p;    // physical inode index
-    for (int i_index_v = 0; i_index_v < size / 2; i_index_v++) {
-        // i_index_v: virtual inode index. (0-indexed)
-        i_index_p = find_inode_index(i_index, i_index_v);
-        if (strcmp(name, inode[i_index_p].i_name) == 0)
-            return i_index_v;
-    }
-    return -1;
+int check_repeat(__u32 i_index, char name[16]) {
+    struct dir_entry entry;
+    int b_index_v;
+    if (!lookup_dir_index(i_index, name, &entry, &b_index_v))
+        return -1;
+    return entry.d_inode;
 }
 
 // go to directory and update access time.
-void goto_dir(__u16 i_index) {
+void goto_dir(__u32 i_index) {
     cur_dir = i_index;
     update_time_total(0, cur_dir);  // update access time
 }
@@ -809,25 +2117,22 @@ int change_dir(char name[16]) {
 
     // handle '..'
     if (strcmp(name, "..") == 0) {
-        goto_dir(inode[cur_dir].i_inode_parent_dir);
+        goto_dir(get_inode(cur_dir)->i_inode_parent_dir);
         return 1;
     }
 
-    // get virtual index
-    int i_index_v = check_repeat(cur_dir, name);
-    if (i_index_v < 0)
+    // get entry, which has physical index and type
+    struct dir_entry entry;
+    int b_index_v;
+    if (!lookup_dir_index(cur_dir, name, &entry, &b_index_v))
         return 0;
 
-    // get physical index
-    int i_index = find_inode_index(cur_dir, i_index_v);
-
     // check directory or file
-    read_disk(3, i_index);
-    if (inode[i_index].i_info % 2 == 0)
+    if (entry.d_type != TYPE_DIR)
         return 0;
 
     // go to directory
-    goto_dir(i_index);
+    goto_dir(entry.d_inode);
 
     return 1;
 }
@@ -836,33 +2141,34 @@ int change_dir(char name[16]) {
 // Range: from 'pos' to the end OR insert all the data.
 // Data will be truncated.
 // pos: 0, 1, ..., 255
-void insert_data_to_block(__u16 i_index, __u16 b_index_v, int pos, int *l, char data[MAX_DATA_LEN]) {
-    __u16 b_index = find_block_index(i_index, b_index_v);
+void insert_data_to_block(__u32 i_index, __u32 b_index_v, int pos, int *l, char data[MAX_DATA_LEN]) {
+    __u32 b_index = find_block_index(i_index, b_index_v);
+    char block_data[BLOCK_SIZE];
 
-    read_disk(4, b_index);
+    read_block(b_index, block_data);
 
     int length = *l;                // 0 ~ length - 1
     int len = length;               // store length
     if (pos + length > 256) {       // data cannot be totally stored in this block
         length = 256 - pos;
-        memcpy(block[b_index].b_data + pos, data, length);  // insert data to block
+        memcpy(block_data + pos, data, length);  // insert data to block
         memcpy(data, data + length, len - length); // truncate data
         *l = *l - length;
     } else {    // remaining data can be totally stored in this block
-        memcpy(block[b_index].b_data + pos, data, length);  // insert data to block
+        memcpy(block_data + pos, data, length);  // insert data to block
     }
 
-    write_disk(4, b_index);
+    write_block(b_index, block_data);
 }
 
 // While inserting data, calculate the new block number,
 // and update new file size.
 // Return: number of added data blocks. (except indirect)
-__u16 cal_block_insert(__u16 i_index, int pos, int l) {
+__u32 cal_block_insert(__u32 i_index, int pos, int l) {
     read_disk(3, i_index);
 
-    int num_block_before = inode[i_index].i_num_block;
-    int size_before = inode[i_index].i_size_file;
+    int num_block_before = get_inode(i_index)->i_num_block;
+    int size_before = get_inode(i_index)->i_size_file;
     if (pos > size_before)
         pos = size_before;
     int size_after = pos + l;
@@ -870,209 +2176,116 @@ __u16 cal_block_insert(__u16 i_index, int pos, int l) {
         size_after = size_before;
 
     // update file size
-    inode[i_index].i_size_file = size_after;
+    get_inode(i_index)->i_size_file = size_after;
     write_disk(3, i_index);
 
     int num_block_after = size_after / BLOCK_SIZE;
     if (size_after % BLOCK_SIZE > 0)
         num_block_after++;
 
-    return (__u16)(num_block_after - num_block_before);
+    return (__u32)(num_block_after - num_block_before);
 }
 
 // Add block and update data block number in inode.
-void add_block(__u16 i_index, int num_block_add) {
+// New blocks are placed right after the last block if possible.
+// If the file would exceed its maximum size or the disk is full,
+//      nothing is added and return -1.
+// Otherwise, return 0.
+int add_block(__u32 i_index, int num_block_add) {
     read_disk(3, i_index);
 
-    int b_before = inode[i_index].i_num_block;
+    int b_before = get_inode(i_index)->i_num_block;
     int b_after = b_before + num_block_add;
-    char b_index_ch[2];
 
-    if (b_after > (8 + 128 + 128 * 128 + 128 * 128 * 128)) {
-        printf("Error: exceed file maximum size.\n");
-        return;
-    }
+    if (b_after > (int) (0xffffffff / BLOCK_SIZE))      // file size is 32 bits
+        return -1;
+    if (!check_free_block(num_block_add, 0))
+        return -1;
 
-    inode[i_index].i_num_block = (__u16) b_after;
+    get_inode(i_index)->i_num_block = b_after;
 
     write_disk(3, i_index);
 
-    for (int i = b_before + 1; i <= b_after; i++) {
-        // the index of direct (data) block in block table
-        __u16 b_index_data;
-        if (1 <= i && i <= 8) {
-            // find direct (data) block
-            b_index_data = find_free_block();
-            inode[i_index].i_block_direct[i - 1] = b_index_data;
-
+    // the first block is placed in the cylinder group of inode
+    int goal = inode_group_block(i_index);
+    if (b_before > 0)
+        goal = find_block_index(i_index, b_before - 1) + 1;
+    for (int i = b_before; i < b_after; i++) {
+        __u32 b_index_data = find_free_block(goal);
+        if (b_index_data == NO_FREE) {
+            // not expected after the check: delete the blocks added
+            read_disk(3, i_index);
+            get_inode(i_index)->i_num_block = b_before;
             write_disk(3, i_index);
-        } else {
-            // the index of indirect block in block table
-            __u16 b_index_single;
-            __u16 b_index_double;
-            __u16 b_index_triple;
-            // the location of data block index in single indirect block (0, 2, ..., 254)
-            int b_loc_data;
-            if (i == (8 + 1)) {
-                // find single indirect block
-                num_block_add++;
-                b_index_single = find_free_block();
-                inode[i_index].i_block_single = b_index_single;
-
-                write_disk(3, i_index);
-                b_loc_data = 0;
-            } else if (i > (8 + 1) && i <= (8 + 128)) {
-                b_index_single = inode[i_index].i_block_single;
-                b_loc_data = (i - 1 - 8) * 2;
-            } else if (i == (8 + 128 + 1)) {
-                num_block_add += 2;
-                b_index_double = find_free_block();
-                inode[i_index].i_block_double = b_index_double;
-
-                write_disk(3, i_index);
-                b_index_single = find_and_set(b_index_double, 0);
-                b_loc_data = 0;
-            } else if (i > (8 + 128 + 1) && i <= (8 + 128 + 128 * 128)) {
-                // the j-th double indirect block
-                // j: [0, 128 * 128 - 1]
-                int j = i - 8 - 128 - 1;
-                int double_index = j / 128;
-                int single_index = j % 128;
-                b_index_double = inode[i_index].i_block_double;
-                if (single_index == 0) {
-                    num_block_add++;
-                    b_index_single = find_and_set(b_index_double, double_index * 2);
-                } else {
-                    b_index_single = find_and_convert(b_index_double, double_index * 2);
-                }
-                b_loc_data = single_index * 2;
-            } else if (i == (8 + 128 + 128 * 128 + 1)) {
-                num_block_add += 3;
-                b_index_triple = find_free_block();
-                inode[i_index].i_block_triple = b_index_triple;
-
-                write_disk(3, i_index);
-                b_index_double = find_and_set(b_index_triple, 0);
-                b_index_single = find_and_set(b_index_double, 0);
-                b_loc_data = 0;
-            } else if (i > (8 + 128 + 128 * 128 + 1) && i <= (8 + 128 + 128 * 128 + 128 * 128 * 128)) {
-                // the k-th triple indirect block
-                // k: [0, 128 * 128 * 128 - 1]
-                int k = i - 8 - 128 - 128 * 128 - 1;
-                int triple_index = k / (128 * 128);
-                int double_index = k / 128 % 128;
-                int single_index = k % 128;
-                b_index_triple = inode[i_index].i_block_triple;
-                if (double_index == 0) {
-                    num_block_add++;
-                    b_index_double = find_and_set(b_index_triple, triple_index * 2);
-                } else {
-                    b_index_double = find_and_convert(b_index_triple, triple_index * 2);
-                }
-                if (single_index == 0) {
-                    num_block_add++;
-                    b_index_single = find_and_set(b_index_double, double_index * 2);
-                } else {
-                    b_index_single = find_and_convert(b_index_double, double_index * 2);
-                }
-                b_loc_data = single_index * 2;
-            }
-            // create direct (data) block
-            find_and_set(b_index_single, b_loc_data);
+            truncate_extent(i_index, b_before);
+            return -1;
         }
+        append_extent(i_index, b_index_data);
+        goal = b_index_data + 1;
     }
+    return 0;
 }
 
 // Read block.
 // If fg == 1, delete block.
 // If 'info' is not NULL, record the accessed data to 'info'.
 // Range: pos_block ~ pos_block + num_block - 1 (virtually)
-// Need to delete indirect block.
+// Blocks can only be deleted at the end of file,
+//      and the empty extent nodes are deleted as well.
 // Do not modify file size.
-void read_del_block(__u16 i_index, int pos_block, int num_block, char *info, int fg) {
+void read_del_block(__u32 i_index, int pos_block, int num_block, char *info, int fg) {
     read_disk(3, i_index);
 
-    // the block index that will be accessed
-    int b_index;
-    int b_index_single;
-    int b_index_double;
-    int b_index_triple;
-
     // update inode
     update_time_total(0, i_index);
     if (fg) {
         update_time_total(1, i_index);
         update_time(2, i_index);
-        inode[i_index].i_num_block -= num_block;
-
-        write_disk(3, i_index);
     }
 
-    // i is 0-indexed
-    for (int i = pos_block; i < pos_block + num_block; i++) {
-        if (i < 8) {
-            b_index = inode[i_index].i_block_direct[i];
-        } else if (i < 8 + 128) {
-            int single_index = i - 8;  // 0 ~ 127
-            b_index_single = inode[i_index].i_block_single;
-            b_index = find_and_convert(b_index_single, single_index * 2);
-            if (single_index == 0 && fg)
-                modify_block_bitmap(b_index_single, 0);
-        } else if (i < 8 + 128 + 128 * 128) {
-            int double_index = (i - 8 - 128) / 128; // 0 ~ 127
-            int single_index = (i - 8 - 128) % 128; // 0 ~ 127
-            b_index_double = inode[i_index].i_block_double;
-            b_index_single = find_and_convert(b_index_double, double_index * 2);
-            b_index = find_and_convert(b_index_single, single_index * 2);
-            if (double_index == 0 && fg)
-                modify_block_bitmap(b_index_double, 0);
-            if (single_index == 0 && fg)
-                modify_block_bitmap(b_index_single, 0);
-        } else if (i < 8 + 128 + 128 * 128 + 128 * 128 * 128) {
-            int triple_index = (i - 8 - 128 - 128 * 128) / (128 * 128); // 0 ~ 127
-            int double_index = (i - 8 - 128 - 128 * 128) / 128 % 128;   // 0 ~ 127
-            int single_index = (i - 8 - 128 - 128 * 128) % 128;         // 0 ~ 127
-            b_index_triple = inode[i_index].i_block_triple;
-            b_index_double = find_and_convert(b_index_triple, triple_index * 2);
-            b_index_single = find_and_convert(b_index_double, double_index * 2);
-            b_index = find_and_convert(b_index_single, single_index * 2);
-            if (triple_index == 0 && fg)
-                modify_block_bitmap(b_index_triple, 0);
-            if (double_index == 0 && fg)
-                modify_block_bitmap(b_index_double, 0);
-            if (single_index == 0 && fg)
-                modify_block_bitmap(b_index_single, 0);
-        }
-        if (info != NULL) {
-            read_disk(4, b_index);
-            memcpy(info, block[b_index].b_data, 256);
+    if (info != NULL) {
+        // i is 0-indexed
+        for (int i = pos_block; i < pos_block + num_block; i++) {
+            if ((i - pos_block) % prefetch_window() == 0)
+                prefetch_block(i_index, i, pos_block + num_block - 1);
+            __u32 b_index = find_block_index(i_index, i);
+            read_block(b_index, info);
             info += 256;
         }
-        // delete data block
-        if (fg)
-            modify_block_bitmap(b_index, 0);
+    }
+
+    // delete data block
+    if (fg) {
+        get_inode(i_index)->i_num_block -= num_block;
+        write_disk(3, i_index);
+        truncate_extent(i_index, pos_block);
     }
 }
 
 // File has been added necessary blocks but those blocks are empty.
 // This function is to add data to those empty blocks.
-void insert_data(__u16 i_index, int pos, int l, char data[MAX_DATA_LEN]) {
+void insert_data(__u32 i_index, int pos, int l, char data[MAX_DATA_LEN]) {
     read_disk(3, i_index);
 
-    int size = inode[i_index].i_size_file;
+    int size = get_inode(i_index)->i_size_file;
     if (pos >= size)
         pos = size;
 
     // find the last virtual block index of this file.
-    __u16 last_block_index_v = (size - 1) / BLOCK_SIZE;
+    __u32 last_block_index_v = (size - 1) / BLOCK_SIZE;
 
     // find the virtual block index of pos.
-    __u16 cur_block_index_v = pos / BLOCK_SIZE;
+    __u32 cur_block_index_v = pos / BLOCK_SIZE;
+
+    __u32 first_block_index_v = cur_block_index_v;
 
     // insert data to block
+    prefetch_block(i_index, cur_block_index_v, last_block_index_v);
     insert_data_to_block(i_index, cur_block_index_v, pos - cur_block_index_v * BLOCK_SIZE, &l, data);
     while (cur_block_index_v < last_block_index_v) {
         cur_block_index_v++;
+        if ((cur_block_index_v - first_block_index_v) % prefetch_window() == 0)
+            prefetch_block(i_index, cur_block_index_v, last_block_index_v);
         insert_data_to_block(i_index, cur_block_index_v, 0, &l, data);
     }
 }
@@ -1080,30 +2293,32 @@ void insert_data(__u16 i_index, int pos, int l, char data[MAX_DATA_LEN]) {
 // Build inode, update time.
 // Set the corresponding bits of the target inode.
 // i_index: The index of the target inode.
-void build_inode(__u16 i_index, __u32 i_info, const char i_name[16], __u32 i_size_file,
-                 __u16 i_num_block, __u16 i_num_link, __u16 i_inode_parent_dir) {
+void build_inode(__u32 i_index, __u32 i_info, const char i_name[16], __u32 i_size_file,
+                 __u32 i_num_block, __u16 i_num_link, __u32 i_inode_parent_dir) {
     read_disk(3, i_index);
 
-    inode[i_index].i_info = i_info;
-    strcpy(inode[i_index].i_name, i_name);
-    inode[i_index].i_size_file = i_size_file;
-    inode[i_index].i_num_block = i_num_block;
-    inode[i_index].i_num_link = i_num_link;
-    inode[i_index].i_inode_parent_dir = i_inode_parent_dir;
+    get_inode(i_index)->i_info = i_info;
+    strcpy(get_inode(i_index)->i_name, i_name);
+    get_inode(i_index)->i_size_file = i_size_file;
+    get_inode(i_index)->i_num_block = i_num_block;
+    get_inode(i_index)->i_extent_num = 0;
+    get_inode(i_index)->i_extent_depth = 0;
+    get_inode(i_index)->i_num_link = i_num_link;
+    get_inode(i_index)->i_inode_parent_dir = i_inode_parent_dir;
 
     write_disk(3, i_index);
 
-    update_time_total(0, inode[i_index].i_inode_parent_dir);    // not access this file
+    update_time_total(0, get_inode(i_index)->i_inode_parent_dir);    // not access this file
     update_time_total(1, i_index);
     update_time(2, i_index);
 }
 
 // Delete inode after update time.
 // Not delete block so that must be called after 'read_del_block'.
-void del_inode(__u16 i_index) {
+void del_inode(__u32 i_index) {
     // do not need to read disk, because the function caller
     //      has already read disk.
-    update_time_total(0, inode[i_index].i_inode_parent_dir);
+    update_time_total(0, get_inode(i_index)->i_inode_parent_dir);
     update_time_total(1, i_index);
     update_time(2, i_index);
     modify_inode_bitmap(i_index, 0);
@@ -1112,69 +2327,154 @@ void del_inode(__u16 i_index) {
 // Modify inode and add data.
 // From pos, add l bytes of data.
 // Update file size and block number.
-void modify_inode_add(__u16 i_index, int pos, int l, char data[MAX_DATA_LEN]) {
+// If blocks cannot be added, the file is not changed and return -1.
+// Otherwise, return 0.
+int modify_inode_add(__u32 i_index, int pos, int l, char data[MAX_DATA_LEN]) {
     update_time_total(0, i_index);   // update access time totally
     update_time_total(1, i_index);   // update modify time totally
     update_time(2, i_index);         // update change time
 
     // Calculate added block number. (Only contain data block)
     // And update file size.
+    read_disk(3, i_index);
+    __u32 size_before = get_inode(i_index)->i_size_file;
     int num_block_add = cal_block_insert(i_index, pos, l);
 
     // Add block physically.
     // And update block number.
-    if (num_block_add > 0)
-        add_block(i_index, num_block_add);
+    if (num_block_add > 0 && add_block(i_index, num_block_add) < 0) {
+        read_disk(3, i_index);
+        get_inode(i_index)->i_size_file = size_before;
+        write_disk(3, i_index);
+        return -1;
+    }
 
     // Insert data.
     insert_data(i_index, pos, l, data);
+    return 0;
 }
 
-// Modify current directory after delete a file or a subdirectory.
-// i_index_v: the virtual index that will be deleted in current dir.
-void modify_cur_dir(__u16 i_index_v) {
-    read_disk(3, cur_dir);
+// Add 'entry' to the last block of directory 'i_index'.
+// The blocks before it are kept nearly full (see 'delete_dir_entry').
+// If there is not enough space, add a new block to directory.
+// The size of directory is always a multiple of BLOCK_SIZE.
+// Return: the virtual block index of the entry, or -1 if the disk is full.
+int add_dir_entry(__u32 i_index, struct dir_entry *entry) {
+    read_disk(3, i_index);
+
+    char data[MAX_DATA_LEN];
+    int b_index_v = get_inode(i_index)->i_num_block - 1;
+    if (b_index_v >= 0) {
+        read_dir_block(i_index, b_index_v, data);
+        int used = dir_block_used(data);
+        if (used + DIR_ENTRY_HEAD + entry->d_name_len <= BLOCK_SIZE) {
+            put_dir_entry(data, used, entry);
+            write_dir_block(i_index, b_index_v, data);
+            update_time_total(0, i_index);
+            update_time_total(1, i_index);
+            update_time(2, i_index);
+            return b_index_v;
+        }
+    }
+
+    bzero(data, BLOCK_SIZE);
+    put_dir_entry(data, 0, entry);
+    if (modify_inode_add(i_index, get_inode(i_index)->i_size_file, BLOCK_SIZE, data) < 0)
+        return -1;
+    return b_index_v + 1;
+}
+
+// Delete 'name' from virtual block 'b_index_v' of directory 'i_index'.
+// Other entries of this block are moved forward.
+// Then entries of the last block are moved to the space freed while they
+//      fit, and their names are moved in the hash index. So the blocks
+//      before the last stay nearly full, and a block which becomes empty
+//      is always the last one.
+// Empty blocks at the end of directory are deleted.
+void delete_dir_entry(__u32 i_index, int b_index_v, const char name[16]) {
+    char data[BLOCK_SIZE], last_data[BLOCK_SIZE];
+    struct dir_entry entry;
+
+    read_dir_block(i_index, b_index_v, data);
+    int pos = find_entry_in_block(data, name, &entry);
+    if (pos < 0)
+        return;
+    int len = DIR_ENTRY_HEAD + entry.d_name_len;
+    memmove(data + pos, data + pos + len, BLOCK_SIZE - pos - len);
+    bzero(data + BLOCK_SIZE - len, len);
 
-    char index_info[8000];
-    int block_num = inode[cur_dir].i_num_block;
-    int file_size = inode[cur_dir].i_size_file;
+    read_disk(3, i_index);
+    int last = get_inode(i_index)->i_num_block - 1;
+    if (b_index_v < last) {
+        int used = dir_block_used(data);
+        read_dir_block(i_index, last, last_data);
+        int last_pos = 0;
+        while ((len = get_dir_entry(last_data, last_pos, &entry)) > 0) {
+            if (used + len > BLOCK_SIZE) {
+                last_pos += len;
+                continue;
+            }
+            put_dir_entry(data, used, &entry);
+            used += len;
+            memmove(last_data + last_pos, last_data + last_pos + len, BLOCK_SIZE - last_pos - len);
+            bzero(last_data + BLOCK_SIZE - len, len);
+            move_dir_index(i_index, entry.d_name, last, b_index_v);
+        }
+        write_dir_block(i_index, last, last_data);
+    }
+    write_dir_block(i_index, b_index_v, data);
 
-    // delete all the index information in current directory
-    inode[cur_dir].i_size_file = 0;
-    write_disk(3, cur_dir);
-    read_del_block(cur_dir, 0, block_num, index_info, 1);
+    update_time_total(0, i_index);
+    update_time_total(1, i_index);
+    update_time(2, i_index);
 
-    // modify index information
-    memcpy(index_info + i_index_v * 2,
-           index_info + (i_index_v + 1) * 2,
-           block_num * 256 - 2);
+    read_disk(3, i_index);
+    while (get_inode(i_index)->i_num_block > 0) {
+        int last = get_inode(i_index)->i_num_block - 1;
+        read_dir_block(i_index, last, data);
+        if (dir_block_used(data) > 0)
+            break;
+        read_del_block(i_index, last, 1, NULL, 1);
+        get_inode(i_index)->i_size_file -= BLOCK_SIZE;
+        write_disk(3, i_index);
+    }
+}
 
-    // insert index information
-    modify_inode_add(cur_dir, 0, file_size - 2, index_info);
+// Modify current directory after delete a file or a subdirectory.
+// name: the name that will be deleted in current dir.
+void modify_cur_dir(char name[16]) {
+    struct dir_entry entry;
+    int b_index_v;
+    if (!lookup_dir_index(cur_dir, name, &entry, &b_index_v))
+        return;
+    delete_dir_index(cur_dir, name, b_index_v);
+    delete_dir_entry(cur_dir, b_index_v, name);
 }
 
 // Delete the given directory or file recursively.
-void del_subdir(__u16 i_index) {
+void del_subdir(__u32 i_index) {
     read_disk(3, i_index);
 
     // If this inode is directory,
     // recursively delete subdir/file.
-    if (inode[i_index].i_info % 2 == 1) {
-        int size = inode[i_index].i_size_file;
-        __u16 i_index_p;    // physical subdir/file index
+    if (get_inode(i_index)->i_info % 2 == 1) {
+        int num_block = get_inode(i_index)->i_num_block;
+        char data[BLOCK_SIZE];
+        struct dir_entry entry;
 
-        // traverse all the index in this inode
-        for (int i_index_v = 0; i_index_v < size / 2; i_index_v++) {
-            // find the physical index
-            i_index_p = find_inode_index(i_index, i_index_v);
+        // traverse all the entries in this directory
+        for (int b_index_v = 0; b_index_v < num_block; b_index_v++) {
+            read_dir_block(i_index, b_index_v, data);
 
             // recursively delete the subdir/file
-            del_subdir(i_index_p);
+            for (int pos = 0, len; (len = get_dir_entry(data, pos, &entry)) > 0; pos += len)
+                del_subdir(entry.d_inode);
         }
+        free_dir_index(get_inode(i_index)->i_dir_index);
     }
 
     // delete block
-    read_del_block(i_index, 0, inode[i_index].i_num_block, NULL, 1);
+    read_del_block(i_index, 0, get_inode(i_index)->i_num_block, NULL, 1);
 
     // delete inode
     del_inode(i_index);
@@ -1213,7 +2513,7 @@ int lex_cmp(char left[16], char right[16]) {
 // Sort array by lexicography name.
 // Use insertion sort.
 // From 0 ~ size - 1.
-void sort_by_lex(struct index_name array[4000], int size) {
+void sort_by_lex(struct index_name *array, int size) {
     struct index_name tmp;
     for (int i = 0; i < size - 1; i++) {
         for (int j = size - 1; j > i; j--) {
@@ -1236,13 +2536,13 @@ void print_usr(int id) {
 void print_cur_dir() {
     char name[64][16];
     int i = 0;
-    __u16 dir_index = cur_dir;
+    __u32 dir_index = cur_dir;
 
     while (dir_index != 0) {
         read_disk(3, dir_index);
 
-        strcpy(name[i], inode[dir_index].i_name);
-        dir_index = inode[dir_index].i_inode_parent_dir;
+        strcpy(name[i], get_inode(dir_index)->i_name);
+        dir_index = get_inode(dir_index)->i_inode_parent_dir;
         i++;
     }
 
@@ -1251,10 +2551,8 @@ void print_cur_dir() {
     sprintf(buffer, ":");
     strcat(client_buffer_w, buffer);
 
-    read_disk(1, 0);
-
     // the system has been formatted
-    if ((inode_bitmap.i_valid_bit[0] & 0b00000001) == 1) {
+    if ((inode_bitmap.bits[0] & 0b00000001) == 1) {
         if (i == 0) {
             printf("/");
             sprintf(buffer, "/");
@@ -1324,17 +2622,17 @@ void print_time(__u32 time) {
 }
 
 // Print inode details.
-void print_inode(__u16 i_index) {
+void print_inode(__u32 i_index) {
     read_disk(3, i_index);
 
-    __u32 i_info = inode[i_index].i_info;
-    __u16 i_num_link = inode[i_index].i_num_link;
-    __u32 i_size_file = inode[i_index].i_size_file;
-    __u32 i_time_access = inode[i_index].i_time_access;
-    __u32 i_time_modify = inode[i_index].i_time_modify;
-    __u32 i_time_change = inode[i_index].i_time_change;
+    __u32 i_info = get_inode(i_index)->i_info;
+    __u16 i_num_link = get_inode(i_index)->i_num_link;
+    __u32 i_size_file = get_inode(i_index)->i_size_file;
+    __u32 i_time_access = get_inode(i_index)->i_time_access;
+    __u32 i_time_modify = get_inode(i_index)->i_time_modify;
+    __u32 i_time_change = get_inode(i_index)->i_time_change;
     __u8 i_name[16];
-    memcpy(i_name, inode[i_index].i_name, 16);
+    memcpy(i_name, get_inode(i_index)->i_name, 16);
 
     // file or directory
     if (i_info % 2 == 0) {  // file
@@ -1404,75 +2702,38 @@ void print_inode(__u16 i_index) {
 
 // Initialize client with disk.c.
 void init_client(char *argv[]) {
-    int disk_portno;
-    struct sockaddr_in disk_serv_addr;
-    struct hostent *disk_server;
-    char host_name[20] = "localhost";   // localhost
-
-    // port number
-    disk_portno = atoi(argv[1]);
-    disk_sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (disk_sockfd < 0) {
-        printf("Error: opening socket.\n");
-        exit(-1);
-    }
-
-    // localhost
-    disk_server = gethostbyname(host_name);
-    if (disk_server == NULL) {
-        printf("Error: no such host.\n");
+    // argv[1]: address of disk.c, see transport.h
+    disk_sockfd = transport_connect(argv[1]);
+}
+
+// Set up a shared-memory ring with disk.c, which carries the later
+//      requests and replies instead of the socket.
+void init_ring() {
+    char name[64];
+    sprintf(name, RING_NAME "%d", getpid());
+    struct ring_shm *shm = ring_create(name);
+    if (shm == NULL) {
+        printf("Error: Could not create ring '%s'.\n", name);
         exit(-1);
     }
-    bzero((char *) &disk_serv_addr, sizeof(disk_serv_addr));
-    disk_serv_addr.sin_family = AF_INET;
-    bcopy((char *) disk_server->h_addr,
-          (char *) &disk_serv_addr.sin_addr.s_addr,
-          disk_server->h_length);
-    disk_serv_addr.sin_port = htons(disk_portno);
-
-    // connect
-    if (connect(disk_sockfd, (struct sockaddr *) &disk_serv_addr, sizeof(disk_serv_addr)) < 0) {
-        printf("Error: connecting.\n");
+    int status = disk_call(DISK_OP_RING, 0, 0, name, strlen(name) + 1, NULL, 0);
+    shm_unlink(name);       // disk.c has mapped it, or never will
+    if (status != DISK_OK) {
+        printf("Error: disk.c refused ring '%s'.\n", name);
         exit(-1);
     }
+    disk_ring = shm;
 }
 
 
 // Initialize server with client.c.
 void init_server(char *argv[]) {
     // server
-    int portno;
-
-    // create socket
-    client_sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_sockfd < 0) {
-        printf("Error: opening socket.\n");
-        exit(-1);
-    }
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    portno = atoi(argv[2]);
-    serv_addr.sin_family = AF_INET;            // IPv4 address
-    serv_addr.sin_addr.s_addr = INADDR_ANY;    // bind the socket
-    serv_addr.sin_port = htons(portno);
-    // htons() converts the port number from host byte order to network byte order
-
-    // bind
-    if (bind(client_sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-        printf("Error: on binding.\n");
-        exit(-1);
-    }
-
-    // listen
-    if (listen(client_sockfd, 5) == -1) {
-        printf("Error: on listening.\n");
-        close(client_sockfd);
-        exit(-1);
-    }
-    clilen = sizeof(cli_addr);
+    client_sockfd = transport_listen(argv[2]);
     printf("Accepting connections ...\n");
 
     // wait for accept
-    client_newsockfd = accept(client_sockfd, (struct sockaddr *) &cli_addr, &clilen);
+    client_newsockfd = transport_accept(client_sockfd);
     if (client_newsockfd < 0) {
         printf("Error: on accept.\n");
         exit(-1);
@@ -1536,6 +2797,20 @@ void read_pos(int *pos) {
     read_num_to_space(pos);
 }
 
+// Reply "No" with 'error', which ends with a period.
+void print_no(const char *error) {
+    fprintf(fs_log, "No\n");
+    if (OUTPUT_STDOUT) {
+        printf("=================== output ====================\n");
+        printf("No\n");
+        printf("Error: %s\n", error);
+        sprintf(buffer, "No\n");
+        strcat(client_buffer_w, buffer);
+        sprintf(buffer, "Error: %s\n", error);
+        strcat(client_buffer_w, buffer);
+    }
+}
+
 // Format file system. Construct a directory named '/'.
 void f_sys_f() {
     get_disk_org();
@@ -1543,13 +2818,14 @@ void f_sys_f() {
     init_super_block();
     init_inode_bitmap();
     init_block_bitmap();
-    init_block();
+    init_memory();
 
     cur_dir = 0;
 
-    __u16 i_index = find_free_inode();
+    __u32 i_index = find_free_inode(0);
 
     build_inode(i_index, INFO_DIR_ALL_ALLOW, "/", 0, 0, 0, 0);  // only update modify/change time
+    create_dir_index(i_index);
 
     fprintf(fs_log, "Done\n");
     if (OUTPUT_STDOUT) {
@@ -1577,15 +2853,43 @@ void f_sys_mk() {
         return;
     }
 
-    __u16 i_index = find_free_inode();  // find free inode index
-    char i_index_ch[2];                 // inode index (string form)
-    itoa_2(i_index, i_index_ch);        // convert index from __u16 to string
+    // a block may be added to current directory, and nodes to its index
+    if (!check_free_block(1, 0)) {
+        print_no("No space left on disk.");
+        return;
+    }
 
-    read_disk(3, cur_dir);
+    // find free inode index in the cylinder group of current directory
+    __u32 i_index = find_free_inode(cur_dir);
+    if (i_index == NO_FREE) {
+        print_no("No free inode.");
+        return;
+    }
+    struct dir_entry entry;             // entry in current directory
+    build_dir_entry(&entry, i_index, TYPE_FILE, f);
 
-    // modify current inode, add block, insert data
+    // add entry to current directory, add block if needed
     // update current directory time
-    modify_inode_add(cur_dir, inode[cur_dir].i_size_file, 2, i_index_ch);
+    int b_index_v = add_dir_entry(cur_dir, &entry);
+    if (b_index_v < 0) {
+        modify_inode_bitmap(i_index, 0);
+        print_no("No space left on disk.");
+        return;
+    }
+
+    // add name to hash index of current directory
+    if (!insert_dir_index(cur_dir, f, b_index_v)) {
+        delete_dir_entry(cur_dir, b_index_v, f);
+        modify_inode_bitmap(i_index, 0);
+        fprintf(fs_log, "No\n");
+        if (OUTPUT_STDOUT) {
+            printf("=================== output ====================\n");
+            printf("No\n");
+            sprintf(buffer, "No\n");
+            strcat(client_buffer_w, buffer);
+        }
+        return;
+    }
 
     // build new inode for file
     // update file time
@@ -1617,19 +2921,48 @@ void f_sys_mkdir() {
         return;
     }
 
-    __u16 i_index = find_free_inode();  // find free inode index
-    char i_index_ch[2];                 // inode index (string form)
-    itoa_2(i_index, i_index_ch);        // convert index from __u16 to string
+    // a block may be added to current directory, and nodes to its index
+    if (!check_free_block(1, 0)) {
+        print_no("No space left on disk.");
+        return;
+    }
 
-    read_disk(3, cur_dir);
+    // find free inode index in the cylinder group chosen for directory
+    __u32 i_index = find_free_inode(find_dir_group(cur_dir));
+    if (i_index == NO_FREE) {
+        print_no("No free inode.");
+        return;
+    }
+    struct dir_entry entry;             // entry in current directory
+    build_dir_entry(&entry, i_index, TYPE_DIR, d);
 
-    // modify current inode, add block, insert data
+    // add entry to current directory, add block if needed
     // update current directory time
-    modify_inode_add(cur_dir, inode[cur_dir].i_size_file, 2, i_index_ch);
+    int b_index_v = add_dir_entry(cur_dir, &entry);
+    if (b_index_v < 0) {
+        modify_inode_bitmap(i_index, 0);
+        print_no("No space left on disk.");
+        return;
+    }
+
+    // add name to hash index of current directory
+    if (!insert_dir_index(cur_dir, d, b_index_v)) {
+        delete_dir_entry(cur_dir, b_index_v, d);
+        modify_inode_bitmap(i_index, 0);
+        fprintf(fs_log, "No\n");
+        if (OUTPUT_STDOUT) {
+            printf("=================== output ====================\n");
+            printf("No\n");
+            sprintf(buffer, "No\n");
+            strcat(client_buffer_w, buffer);
+        }
+        return;
+    }
 
     // build new inode for directory
     // update file time
     build_inode(i_index, INFO_DIR_ALL_ALLOW, d, 0, 0, 1, cur_dir);
+    create_dir_index(i_index);
 
     fprintf(fs_log, "Yes\n");
     if (OUTPUT_STDOUT) {
@@ -1645,8 +2978,8 @@ void f_sys_rm() {
     read_name(f);
 
     // check for existence and get inode index
-    int i_index_v = check_repeat(cur_dir, f);           // virtual index
-    if (i_index_v < 0) {
+    int i_index = check_repeat(cur_dir, f);             // physical index
+    if (i_index < 0) {
         fprintf(fs_log, "No\n");
         if (OUTPUT_STDOUT) {
             printf("=================== output ====================\n");
@@ -1659,11 +2992,9 @@ void f_sys_rm() {
         }
         return;
     }
-    int i_index = find_inode_index(cur_dir, i_index_v); // physical index
-
     read_disk(3, i_index);
 
-    if (inode[i_index].i_info % 2 == 1) {
+    if (get_inode(i_index)->i_info % 2 == 1) {
         fprintf(fs_log, "No\n");
         if (OUTPUT_STDOUT) {
             printf("=================== output ====================\n");
@@ -1681,7 +3012,7 @@ void f_sys_rm() {
     del_subdir(i_index);
 
     // modify current directory
-    modify_cur_dir(i_index_v);
+    modify_cur_dir(f);
 
     fprintf(fs_log, "Yes\n");
     if (OUTPUT_STDOUT) {
@@ -1754,8 +3085,8 @@ void f_sys_rmdir() {
     read_name(d);
 
     // check for existence and get inode index
-    int i_index_v = check_repeat(cur_dir, d);           // virtual index
-    if (i_index_v < 0) {
+    int i_index = check_repeat(cur_dir, d);             // physical index
+    if (i_index < 0) {
         fprintf(fs_log, "No\n");
         if (OUTPUT_STDOUT) {
             printf("=================== output ====================\n");
@@ -1768,11 +3099,9 @@ void f_sys_rmdir() {
         }
         return;
     }
-    int i_index = find_inode_index(cur_dir, i_index_v); // physical index
-
     read_disk(3, i_index);
 
-    if (inode[i_index].i_info % 2 == 0) {
+    if (get_inode(i_index)->i_info % 2 == 0) {
         fprintf(fs_log, "No\n");
         if (OUTPUT_STDOUT) {
             printf("=================== output ====================\n");
@@ -1790,7 +3119,7 @@ void f_sys_rmdir() {
     del_subdir(i_index);
 
     // modify current directory
-    modify_cur_dir(i_index_v);
+    modify_cur_dir(d);
 
     fprintf(fs_log, "Yes\n");
     if (OUTPUT_STDOUT) {
@@ -1801,32 +3130,55 @@ void f_sys_rmdir() {
     }
 }
 
+// Append entry 'entry' to 'array' of 'size' entries, with room for 'capacity'.
+void add_index_name(struct index_name **array, int *size, int *capacity, struct dir_entry *entry) {
+    if (*size == *capacity) {
+        *capacity = *capacity * 2 + 64;
+        struct index_name *p = (struct index_name *) realloc(*array, *capacity * sizeof(struct index_name));
+        if (p == NULL) {
+            printf("Error: Could not allocate the names of 'ls'.\n");
+            exit(-1);
+        }
+        *array = p;
+    }
+    strcpy((*array)[*size].name, entry->d_name);
+    (*array)[*size].index = entry->d_inode;
+    (*size)++;
+}
+
+// Return: 1 if the output of 'ls' is cut before the next name, as its
+//      line might overflow client_buffer_w, 0 if not.
+// The output is cut once, with "...".
+int ls_cut(int *cut) {
+    if (!*cut && strlen(client_buffer_w) + LS_LINE_LEN >= MAX_LEN) {
+        printf("...\n");
+        strcat(client_buffer_w, "...\n");
+        *cut = 1;
+    }
+    return *cut;
+}
+
 void f_sys_ls() {
     read_disk(3, cur_dir);
 
-    struct index_name file[4000];
-    struct index_name dir[4000];
-    int size = inode[cur_dir].i_size_file;
-    __u16 i_index_p;  //physical index
+    struct index_name *file = NULL;
+    struct index_name *dir = NULL;
+    int file_capacity = 0, dir_capacity = 0;
+    int num_block = get_inode(cur_dir)->i_num_block;
+    char data[BLOCK_SIZE];
+    struct dir_entry entry;
     int i = 0, j = 0;
-
-    // traverse all the index in this node
-    for (int i_index_v = 0; i_index_v < size / 2; i_index_v++) {
-        // find the physical index
-        i_index_p = find_inode_index(cur_dir, i_index_v);
-
-        read_disk(3, i_index_p);
-
-        if (inode[i_index_p].i_info % 2 == 0) {
-            // file
-            strcpy(file[i].name, inode[i_index_p].i_name);
-            file[i].index = i_index_p;
-            i++;
-        } else {
-            // directory
-            strcpy(dir[j].name, inode[i_index_p].i_name);
-            dir[j].index = i_index_p;
-            j++;
+    int cut = 0;
+
+    // traverse all the entries in this directory
+    // only the blocks of directory are read
+    for (int b_index_v = 0; b_index_v < num_block; b_index_v++) {
+        read_dir_block(cur_dir, b_index_v, data);
+        for (int pos = 0, len; (len = get_dir_entry(data, pos, &entry)) > 0; pos += len) {
+            if (entry.d_type == TYPE_FILE)
+                add_index_name(&file, &i, &file_capacity, &entry);   // file
+            else
+                add_index_name(&dir, &j, &dir_capacity, &entry);     // directory
         }
     }
 
@@ -1841,7 +3193,7 @@ void f_sys_ls() {
     // output all the file/dir names
     for (int ii = 0; ii < i; ii++) {
         fprintf(fs_log, "%s ", file[ii].name);
-        if (OUTPUT_STDOUT) {
+        if (OUTPUT_STDOUT && !ls_cut(&cut)) {
             if (OUTPUT_DETAIL) {
                 print_inode(file[ii].index);
             } else {
@@ -1852,14 +3204,14 @@ void f_sys_ls() {
         }
     }
     fprintf(fs_log, "& ");
-    if (OUTPUT_STDOUT && !OUTPUT_DETAIL) {
+    if (OUTPUT_STDOUT && !OUTPUT_DETAIL && !cut) {
         printf("& ");
         sprintf(buffer, "& ");
         strcat(client_buffer_w, buffer);
     }
     for (int jj = 0; jj < j; jj++) {
         fprintf(fs_log, "%s ", dir[jj].name);
-        if (OUTPUT_STDOUT) {
+        if (OUTPUT_STDOUT && !ls_cut(&cut)) {
             if (OUTPUT_DETAIL) {
                 print_inode(dir[jj].index);
             } else {
@@ -1872,11 +3224,14 @@ void f_sys_ls() {
     fprintf(fs_log, "\n");
 
     // while i = j = 0, it must send a '\n'
-    if ((OUTPUT_STDOUT && !OUTPUT_DETAIL) || (i + j == 0)) {
+    // a cut output has ended with "...\n"
+    if (((OUTPUT_STDOUT && !OUTPUT_DETAIL) || (i + j == 0)) && !cut) {
         printf("\n");
         sprintf(buffer, "\n");
         strcat(client_buffer_w, buffer);
     }
+    free(file);
+    free(dir);
 }
 
 void f_sys_cat() {
@@ -1884,8 +3239,8 @@ void f_sys_cat() {
     read_name(f);
 
     // check for existence and get inode index
-    int i_index_v = check_repeat(cur_dir, f);           // virtual index
-    if (i_index_v < 0) {
+    int i_index = check_repeat(cur_dir, f);             // physical index
+    if (i_index < 0) {
         fprintf(fs_log, "No\n");
         if (OUTPUT_STDOUT) {
             printf("=================== output ====================\n");
@@ -1898,11 +3253,9 @@ void f_sys_cat() {
         }
         return;
     }
-    int i_index = find_inode_index(cur_dir, i_index_v); // physical index
-
     read_disk(3, i_index);
 
-    if (inode[i_index].i_info % 2 == 1) {
+    if (get_inode(i_index)->i_info % 2 == 1) {
         fprintf(fs_log, "No\n");
         if (OUTPUT_STDOUT) {
             printf("=================== output ====================\n");
@@ -1916,19 +3269,34 @@ void f_sys_cat() {
         return;
     }
 
+    // the file and a newline must fit the reply to client.c
+    int num_block = get_inode(i_index)->i_num_block;
+    if (OUTPUT_STDOUT &&
+            (long) num_block * BLOCK_SIZE + 2 > (long) (MAX_LEN - strlen(client_buffer_w))) {
+        char error[64];
+        sprintf(error, "'%s' is too large to print.", f);
+        print_no(error);
+        return;
+    }
+    char *data = (char *) malloc(num_block * BLOCK_SIZE + 1);
+    if (data == NULL) {
+        print_no("Could not allocate memory.");
+        return;
+    }
+
     // read block
-    char data[BLOCK_SIZE * 1024];
-    data[inode[i_index].i_num_block * BLOCK_SIZE] = '\0';
-    read_del_block(i_index, 0, inode[i_index].i_num_block, data, 0);
+    data[num_block * BLOCK_SIZE] = '\0';
+    read_del_block(i_index, 0, num_block, data, 0);
 
     // output data
     fprintf(fs_log, "%s\n", data);
     if (OUTPUT_STDOUT || (strlen(data) == 0)) {
         printf("=================== output ====================\n");
         printf("%s\n", data);
-        sprintf(buffer, "%s\n", data);
-        strcat(client_buffer_w, buffer);
+        strcat(client_buffer_w, data);
+        strcat(client_buffer_w, "\n");
     }
+    free(data);
 }
 
 void f_sys_w() {
@@ -1936,8 +3304,8 @@ void f_sys_w() {
     read_name(f);
 
     // check for existence and get inode index
-    int i_index_v = check_repeat(cur_dir, f);           // virtual index
-    if (i_index_v < 0) {
+    int i_index = check_repeat(cur_dir, f);             // physical index
+    if (i_index < 0) {
         fprintf(fs_log, "No\n");
         if (OUTPUT_STDOUT) {
             printf("=================== output ====================\n");
@@ -1951,11 +3319,9 @@ void f_sys_w() {
         return;
     }
 
-    int i_index = find_inode_index(cur_dir, i_index_v); // physical index
-
     read_disk(3, i_index);
 
-    if (inode[i_index].i_info % 2 == 1) {
+    if (get_inode(i_index)->i_info % 2 == 1) {
         fprintf(fs_log, "No\n");
         if (OUTPUT_STDOUT) {
             printf("=================== output ====================\n");
@@ -1974,16 +3340,25 @@ void f_sys_w() {
     read_length(&l);
     read_data(data);
 
+    // the blocks of file are replaced by those of data
+    if (!check_free_block((l + BLOCK_SIZE - 1) / BLOCK_SIZE, get_inode(i_index)->i_num_block)) {
+        print_no("No space left on disk.");
+        return;
+    }
+
     // delete block and modify block number
-    read_del_block(i_index, 0, inode[i_index].i_num_block, NULL, 1);
+    read_del_block(i_index, 0, get_inode(i_index)->i_num_block, NULL, 1);
 
     // modify file size
-    inode[i_index].i_size_file = 0;
+    get_inode(i_index)->i_size_file = 0;
 
     write_disk(3, i_index);
 
     // insert at 0
-    modify_inode_add(i_index, 0, l, data);
+    if (modify_inode_add(i_index, 0, l, data) < 0) {
+        print_no("No space left on disk.");
+        return;
+    }
 
     fprintf(fs_log, "Yes\n");
     if (OUTPUT_STDOUT) {
@@ -1999,8 +3374,8 @@ void f_sys_i() {
     read_name(f);
 
     // check for existence and get inode index
-    int i_index_v = check_repeat(cur_dir, f);           // virtual index
-    if (i_index_v < 0) {
+    int i_index = check_repeat(cur_dir, f);             // physical index
+    if (i_index < 0) {
         fprintf(fs_log, "No\n");
         if (OUTPUT_STDOUT) {
             printf("=================== output ====================\n");
@@ -2013,11 +3388,9 @@ void f_sys_i() {
         }
         return;
     }
-    int i_index = find_inode_index(cur_dir, i_index_v); // physical index
-
     read_disk(3, i_index);
 
-    if (inode[i_index].i_info % 2 == 1) {
+    if (get_inode(i_index)->i_info % 2 == 1) {
         fprintf(fs_log, "No\n");
         if (OUTPUT_STDOUT) {
             printf("=================== output ====================\n");
@@ -2032,23 +3405,42 @@ void f_sys_i() {
     }
 
     int pos, l, size;
-    char data[MAX_DATA_LEN], init_data[BLOCK_SIZE * 1024];
+    char data[MAX_DATA_LEN];
     read_pos(&pos);
     read_length(&l);
     read_data(data);
 
-    size = inode[i_index].i_size_file;
+    size = get_inode(i_index)->i_size_file;
     if (pos > size)
         pos = size;
+    if (l < 0 || (long) size + l > INT_MAX) {
+        char error[64];
+        sprintf(error, "'%s' would exceed the maximum file size.", f);
+        print_no(error);
+        return;
+    }
 
-    // delete block and modify block number
-    // record the initial data
+    // the blocks from 'pos' on are rewritten with the data inserted
     int remain_block = pos / BLOCK_SIZE;
     int remain_size = remain_block * BLOCK_SIZE;
-    read_del_block(i_index, remain_block, inode[i_index].i_num_block - remain_block, init_data, 1);
+    int tail_block = get_inode(i_index)->i_num_block - remain_block;
+    int new_block = (int) (((long) size + l + BLOCK_SIZE - 1) / BLOCK_SIZE) - remain_block;
+    if (!check_free_block(new_block, tail_block)) {
+        print_no("No space left on disk.");
+        return;
+    }
+    char *init_data = (char *) malloc((long) tail_block * BLOCK_SIZE + l + 1);
+    if (init_data == NULL) {
+        print_no("Could not allocate memory.");
+        return;
+    }
+
+    // delete block and modify block number
+    // record the initial data
+    read_del_block(i_index, remain_block, tail_block, init_data, 1);
 
     // modify file size
-    inode[i_index].i_size_file = remain_size;
+    get_inode(i_index)->i_size_file = remain_size;
 
     write_disk(3, i_index);
 
@@ -2062,7 +3454,12 @@ void f_sys_i() {
     init_data[size + l - remain_size] = '\0';
 
     // insert at remain size
-    modify_inode_add(i_index, remain_size, size + l - remain_size, init_data);
+    int ret = modify_inode_add(i_index, remain_size, size + l - remain_size, init_data);
+    free(init_data);
+    if (ret < 0) {
+        print_no("No space left on disk.");
+        return;
+    }
 
     fprintf(fs_log, "Yes\n");
     if (OUTPUT_STDOUT) {
@@ -2078,8 +3475,8 @@ void f_sys_d() {
     read_name(f);
 
     // check for existence and get inode index
-    int i_index_v = check_repeat(cur_dir, f);           // virtual index
-    if (i_index_v < 0) {
+    int i_index = check_repeat(cur_dir, f);             // physical index
+    if (i_index < 0) {
         fprintf(fs_log, "No\n");
         if (OUTPUT_STDOUT) {
             printf("=================== output ====================\n");
@@ -2092,11 +3489,9 @@ void f_sys_d() {
         }
         return;
     }
-    int i_index = find_inode_index(cur_dir, i_index_v); // physical index
-
     read_disk(3, i_index);
 
-    if (inode[i_index].i_info % 2 == 1) {
+    if (get_inode(i_index)->i_info % 2 == 1) {
         fprintf(fs_log, "No\n");
         if (OUTPUT_STDOUT) {
             printf("=================== output ====================\n");
@@ -2111,11 +3506,10 @@ void f_sys_d() {
     }
 
     int pos, l, size;
-    char init_data[BLOCK_SIZE * 1024];
     read_pos(&pos);
     read_length(&l);
 
-    size = inode[i_index].i_size_file;
+    size = get_inode(i_index)->i_size_file;
     if (pos + l > size)
         l = size - pos;
     if (l > 0) {
@@ -2124,10 +3518,21 @@ void f_sys_d() {
         // record the initial data
         int remain_block = pos / BLOCK_SIZE;
         int remain_size = remain_block * BLOCK_SIZE;
-        read_del_block(i_index, remain_block, inode[i_index].i_num_block - remain_block, init_data, 1);
+        int tail_block = get_inode(i_index)->i_num_block - remain_block;
+        int new_block = (size - l + BLOCK_SIZE - 1) / BLOCK_SIZE - remain_block;
+        if (!check_free_block(new_block, tail_block)) {
+            print_no("No space left on disk.");
+            return;
+        }
+        char *init_data = (char *) malloc((long) tail_block * BLOCK_SIZE + 1);
+        if (init_data == NULL) {
+            print_no("Could not allocate memory.");
+            return;
+        }
+        read_del_block(i_index, remain_block, tail_block, init_data, 1);
 
         // modify file size
-        inode[i_index].i_size_file = remain_size;
+        get_inode(i_index)->i_size_file = remain_size;
 
         write_disk(3, i_index);
 
@@ -2136,7 +3541,12 @@ void f_sys_d() {
         init_data[size - l - remain_size] = '\0';
 
         // insert at remain size
-        modify_inode_add(i_index, remain_size, size - l - remain_size, init_data);
+        int ret = modify_inode_add(i_index, remain_size, size - l - remain_size, init_data);
+        free(init_data);
+        if (ret < 0) {
+            print_no("No space left on disk.");
+            return;
+        }
     }
 
     fprintf(fs_log, "Yes\n");
@@ -2148,6 +3558,29 @@ void f_sys_d() {
     }
 }
 
+// Print hit/miss counters of buffer cache.
+void print_cache_stat() {
+    printf("buffer cache: %d hits, %d misses, %d write-backs\n",
+           cache_hit, cache_miss, cache_write_back);
+}
+
+// Print the requests to disk.c and their simulated time.
+void print_disk_stat() {
+    printf("disk: %d requests, %d in flight at most, simulated time %ld\n",
+           disk_request_id, disk_pending_max, disk_time);
+}
+
+// Print how many inode block writes are eliminated by inode cache.
+void print_inode_stat() {
+    printf("inode cache: %d inode writes, %d block writes, %d eliminated\n",
+           inode_write, inode_write_block, inode_write - inode_write_block);
+}
+
+// Print how many blocks are mapped without walking the extent tree.
+void print_extent_map_stat() {
+    printf("extent map: %d hits, %d misses\n", extent_map_hit, extent_map_miss);
+}
+
 // =========================================================
 // Test function.
 void test() {
@@ -2156,27 +3589,30 @@ void test() {
     //      block[0] ~ block[num * 8 - 1]
     int num = 2;
 
-    read_disk(0, 0);
-    read_disk(1, 0);
-    read_disk(2, 0);
     printf("=================== Test ======================\n");
     printf("inode num: %d\n", super_block.s_count_inode);
     printf("block num: %d\n", super_block.s_count_block);
     printf("current directory: %d\n", cur_dir);
+    print_cache_stat();
+    print_disk_stat();
+    print_inode_stat();
+    print_extent_map_stat();
     for (int i = 0; i < num; i++) {
         for (int j = i * 8; j < i * 8 + 8; j++) {
-            printf("inode %d: bit = %d", j, inode_bitmap.i_valid_bit[i]);
+            printf("inode %d: bit = %d", j, inode_bitmap.bits[i]);
             read_disk(3, j);
-            printf(", size: %d", inode[j].i_size_file);
-            printf(", name: %s", inode[j].i_name);
+            printf(", size: %d", get_inode(j)->i_size_file);
+            printf(", name: %s", get_inode(j)->i_name);
             printf("\n");
         }
     }
     for (int i = 0; i < num; i++) {
         for (int j = i * 8; j < i * 8 + 8; j++) {
-            printf("block %d: bit = %d", j, block_bitmap.b_valid_bit[i]);
-            read_disk(4, j);
-            printf(", data: %s", block[j].b_data);
+            char data[BLOCK_SIZE + 1];
+            printf("block %d: bit = %d", j, block_bitmap.bits[i]);
+            read_block(j, data);
+            data[BLOCK_SIZE] = '\0';
+            printf(", data: %s", data);
             printf("\n");
         }
     }
@@ -2194,15 +3630,14 @@ void memory_polling() {
     char command[16];
     int state = 1;
 
+    inode_cache_reset();
     if (SOCKET_OPEN) {
         // read information from disk.
         get_disk_org();
-        read_disk(0, 0);
-        read_disk(1, 0);
-        read_disk(2, 0);
+        meta_load();
         for (int i = 0; i < 16; i++)
             read_disk(3, i);
-        if ((inode_bitmap.i_valid_bit[0] & 0b00000001) == 1)
+        if ((inode_bitmap.bits[0] & 0b00000001) == 1)
             cur_dir = 0;
     }
 
@@ -2228,6 +3663,7 @@ void memory_polling() {
         }
 
         if (SOCKET_OPEN) {  // read the output of fs
+            meta_flush_wait();
             server_read(client_buffer);
 
             printf("command: %s\n", client_buffer);
@@ -2246,6 +3682,7 @@ void memory_polling() {
 
         // read command from client_buffer
         read_command(command);
+        command_count++;
 
         // execute command
         if (0 == strcmp("f", command)) {
@@ -2271,14 +3708,21 @@ void memory_polling() {
         } else if (0 == strcmp("d", command)) {
             f_sys_d();
         } else if (0 == strcmp("e", command)) {
+            meta_flush(1);
+            inode_flush();
+            cache_flush();
+            if (SOCKET_OPEN)    // all on storage before exit, whatever disk.c syncs
+                disk_call(DISK_OP_FLUSH, 0, 1, NULL, 0, NULL, 0);
+            print_cache_stat();
+            print_disk_stat();
+            print_inode_stat();
+            print_extent_map_stat();
             fprintf(fs_log, "Goodbye!\n");
             if (OUTPUT_STDOUT) {
                 printf("=================== output ====================\n");
                 printf("Goodbye!\n");
                 if (SOCKET_OPEN) {
-                    disk_buffer_w[0] = 'E';
-                    disk_buffer_w[1] = '\0';
-                    client_write(1);
+                    disk_call(DISK_OP_EXIT, 0, 1, NULL, 0, NULL, 0);
                 }
             }
             state = 0;
@@ -2291,6 +3735,12 @@ void memory_polling() {
             }
         }
 
+        // write the dirty metadata and blocks of this command to disk
+        meta_flush(0);
+        inode_flush();
+        inode_cache_trim();
+        cache_flush();
+
         if (SOCKET_OPEN) {
             server_write();
 
@@ -2306,16 +3756,51 @@ void memory_polling() {
 }
 
 int main(int argc, char *argv[]) {
+    int opt;
+
+    // options:
+    //      -c <blocks>: budget of buffer cache
+    //      -m <seconds>: interval of writing super block and bitmaps
+    //      -g <groups>: number of cylinder groups for formatting
+    //      -r: talk to disk.c through a shared-memory ring
+    while ((opt = getopt(argc, argv, "c:m:g:r")) != -1) {
+        switch (opt) {
+            case 'c':
+                cache_size = atoi(optarg);
+                if (cache_size <= 0) {
+                    printf("Error: invalid cache size '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'm':
+                meta_flush_interval = atoi(optarg);
+                break;
+            case 'g':
+                cg_num_format = atoi(optarg);
+                break;
+            case 'r':
+                use_ring = 1;
+                break;
+            default:
+                printf("Usage: %s [-c blocks] [-m seconds] [-g groups] [-r] disk_address fs_address\n", argv[0]);
+                exit(-1);
+        }
+    }
+    argv += optind - 1;     // argv[1], argv[2]: addresses, see transport.h
+
+    cache_init();
 
     if (SOCKET_OPEN) {
         init_client(argv);
+        if (use_ring)
+            init_ring();
         init_server(argv);
     }
 
     memory_polling();
 
     if (SOCKET_OPEN) {
-        close(client_sockfd);
+        transport_close(client_sockfd, argv[2]);
         close(client_newsockfd);
         close(disk_sockfd);
     }
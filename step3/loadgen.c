@@ -0,0 +1,386 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include <asm/types.h>
+#include "protocol.h"
+#include "disk_client.h"
+
+// Generate a synthetic load on a disk server, as fio does, and report
+//      its IOPS, bandwidth, latency and simulated seek cost.
+// Requests of 'count' blocks go through one connection, with 'depth'
+//      of them in flight, until 'seconds' pass or 'total' are replied.
+// The disk is taken as units of 'count' blocks, from its geometry of 'I',
+//      and the first block of each request is chosen by a pattern:
+//      seq:    the units in order
+//      stride: every 'stride' blocks, around the disk
+//      rand:   units uniformly at random
+//      zipf:   units skewed by Zipf's law with exponent 'theta', so that
+//              few units get most requests; the ranks are scattered
+//              over the disk, not packed at its start
+// Each request is a read with probability 'reads' %, or else a write of
+//      a pattern. The same seed gives the same requests.
+// Usage: ./loadgen [-p pattern] [-m reads] [-b count] [-s stride] [-z theta]
+//                  [-q depth] [-t seconds] [-n total] [-S seed] address
+
+#define BLOCK_SIZE 256
+#define DEPTH 16            // default queue depth
+#define MAX_DEPTH 1024
+#define SECONDS 10          // default duration
+#define HIST 32             // buckets of latency histogram, by powers of 2 in us
+#define HIST_BAR 40         // the longest bar of histogram
+
+#define PATTERN_SEQ 0
+#define PATTERN_STRIDE 1
+#define PATTERN_RAND 2
+#define PATTERN_ZIPF 3
+static const char *pattern_names[] = {"seq", "stride", "rand", "zipf"};
+
+static int pattern = PATTERN_RAND;
+static int reads = 100;             // % of reads
+static __u32 count = 1;             // blocks per request
+static __u32 stride;                // blocks between requests of stride, a cylinder by default
+static double theta = 1.1;          // exponent of zipf
+static int depth = DEPTH;
+static double seconds = SECONDS;
+static long total;                  // the most requests, 0 for no limit
+static __u64 seed = 1;
+
+static __u32 cylinders, sectors_pc;
+static __u32 units;                 // units of 'count' blocks on disk
+static __u32 cursor;                // the next block of seq and stride
+static double *zipf_cdf;            // cumulative probability of ranks of zipf
+static __u64 *sent;                 // time of sending the request of each slot (ns)
+static __u8 *slot_op;               // opcode of each slot, 0 if free
+static long *latency;               // latencies in order of reply (ns)
+static long latency_num, latency_size;
+static long hist[HIST];
+static char payload[DISK_MAX_LEN];       // payload of request
+static char reply_data[DISK_MAX_LEN];
+
+// Return: the next pseudo-random number (xorshift64*).
+__u64 next_random() {
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed * 2685821657736338717ULL;
+}
+
+// Return: a pseudo-random number in [0, 1).
+double next_uniform() {
+    return (next_random() >> 11) * (1.0 / (1ULL << 53));
+}
+
+// Compute the cumulative probabilities of the ranks of zipf.
+void init_zipf() {
+    zipf_cdf = (double *) malloc(units * sizeof(double));
+    if (zipf_cdf == NULL) {
+        printf("Error: Could not allocate zipf.\n");
+        exit(-1);
+    }
+    double sum = 0;
+    for (__u32 i = 0; i < units; i++) {
+        sum += 1 / pow(i + 1, theta);
+        zipf_cdf[i] = sum;
+    }
+    for (__u32 i = 0; i < units; i++)
+        zipf_cdf[i] /= sum;
+}
+
+// Return: the first block of the next request.
+__u32 next_lba() {
+    __u32 lba, rank;
+    switch (pattern) {
+        case PATTERN_SEQ:
+        case PATTERN_STRIDE:
+            lba = cursor;
+            cursor += pattern == PATTERN_SEQ ? count : stride;
+            if (cursor + count > units * count)
+                cursor = pattern == PATTERN_SEQ ? 0 : cursor % (units * count - count + 1);
+            return lba;
+        case PATTERN_RAND:
+            return next_random() % units * count;
+        default: {
+            // the first rank whose cumulative probability passes u
+            double u = next_uniform();
+            __u32 lo = 0, hi = units - 1;
+            while (lo < hi) {
+                __u32 mid = lo + (hi - lo) / 2;
+                if (zipf_cdf[mid] < u)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            // a multiplier prime to 'units' scatters the ranks, one to one
+            rank = lo;
+            return (__u32) ((__u64) rank * 2654435761ULL % units) * count;
+        }
+    }
+}
+
+// Send the next request in free slot 'k', with id k + 1.
+void send_request(int k, long n) {
+    __u8 op = (int) (next_random() % 100) < reads ? DISK_OP_READ : DISK_OP_WRITE;
+    __u32 lba = next_lba();
+    int length = 0;
+    if (op == DISK_OP_WRITE) {
+        length = count * BLOCK_SIZE;
+        memset(payload, 'a' + n % 26, length);
+    }
+    slot_op[k] = op;
+    sent[k] = now_ns();
+    disk_send(op, k + 1, lba, count, payload, length);
+}
+
+// Record latency 'ns' of a reply.
+void add_latency(long ns) {
+    if (latency_num == latency_size) {
+        latency_size = latency_size * 2 + 4096;
+        latency = (long *) realloc(latency, latency_size * sizeof(long));
+        if (latency == NULL) {
+            printf("Error: Could not allocate latencies.\n");
+            exit(-1);
+        }
+    }
+    latency[latency_num++] = ns;
+    int b = 0;
+    while (b < HIST - 1 && (ns / 1000) >> b > 0)
+        b++;
+    hist[b]++;
+}
+
+// Print histogram 'h' of 'n' buckets, bucket 0 for 0, bucket 1 for 1
+//      and bucket i for 2^(i-1) ~ 2^i - 1, in 'unit'.
+void print_hist(const char *title, const char *unit, const long *h, int n) {
+    long max = 0, sum = 0;
+    int first = n, last = 0;
+    for (int i = 0; i < n; i++) {
+        if (h[i] == 0)
+            continue;
+        if (first == n)
+            first = i;
+        last = i;
+        sum += h[i];
+        if (h[i] > max)
+            max = h[i];
+    }
+    printf("%s:\n", title);
+    for (int i = first; i <= last; i++) {
+        char range[48];         // two 64-bit numbers at most
+        if (i <= 1)
+            snprintf(range, sizeof(range), "%d", i);
+        else if (i == n - 1)
+            snprintf(range, sizeof(range), ">= %lu", 1UL << (i - 1));
+        else
+            snprintf(range, sizeof(range), "%lu ~ %lu", 1UL << (i - 1), (1UL << i) - 1);
+        printf("  %16s %-3s %9ld %6.2f%% ", range, unit, h[i], 100.0 * h[i] / sum);
+        for (int j = 0; j < (h[i] * HIST_BAR + max - 1) / max; j++)
+            putchar('#');
+        putchar('\n');
+    }
+}
+
+// Run the load, and print the results.
+void run() {
+    sent = (__u64 *) malloc(depth * sizeof(__u64));
+    slot_op = (__u8 *) calloc(depth, sizeof(__u8));
+    if (sent == NULL || slot_op == NULL) {
+        printf("Error: Could not allocate slots.\n");
+        exit(-1);
+    }
+
+    long issued = 0, read_num = 0, write_num = 0, errors = 0;
+    int inflight = 0;
+    __u64 start = now_ns();
+    __u64 end = start + (__u64) (seconds * 1e9);
+    int free_slot = 0;
+    while (1) {
+        // keep 'depth' requests in flight until the end
+        int running = now_ns() < end && (total == 0 || issued < total);
+        while (running && inflight < depth && (total == 0 || issued < total)) {
+            while (slot_op[free_slot])
+                free_slot = (free_slot + 1) % depth;
+            send_request(free_slot, issued++);
+            inflight++;
+        }
+        if (inflight == 0)
+            break;
+
+        struct disk_reply reply = read_reply(reply_data);
+        if (reply.id < 1 || reply.id > (__u32) depth || slot_op[reply.id - 1] == 0) {
+            printf("Error: wrong reply from disk.c.\n");
+            exit(-1);
+        }
+        int k = reply.id - 1;
+        add_latency(now_ns() - sent[k]);
+        if (reply.status != DISK_OK)
+            errors++;
+        else if (slot_op[k] == DISK_OP_READ)
+            read_num++;
+        else
+            write_num++;
+        slot_op[k] = 0;
+        inflight--;
+    }
+    double s = (now_ns() - start) / 1e9;
+
+    // statistics of this connection from disk.c
+    struct disk_stat st[2];
+    bzero(st, sizeof(st));
+    disk_send(DISK_OP_STAT, 0, 0, 0, NULL, 0);
+    struct disk_reply reply = read_reply(reply_data);
+    if (reply.status == DISK_OK && reply.length == sizeof(st))
+        memcpy(st, reply_data, sizeof(st));
+    disk_send(DISK_OP_EXIT, 0, 0, 0, NULL, 0);
+    read_reply(reply_data);
+
+    printf("%s, %d%% reads, %u blocks, depth %d, disk of %u x %u: %ld requests in %.2f s\n",
+           pattern_names[pattern], reads, count, depth, cylinders, sectors_pc, latency_num, s);
+    if (s > 0) {
+        double mb = (double) count * BLOCK_SIZE / 1e6;
+        printf("IOPS: %.0f (read %.0f, write %.0f)\n",
+               latency_num / s, read_num / s, write_num / s);
+        printf("bandwidth: %.2f MB/s (read %.2f, write %.2f)\n",
+               (read_num + write_num) * mb / s, read_num * mb / s, write_num * mb / s);
+    }
+    printf("errors: %ld\n", errors);
+    if (latency_num > 0) {
+        qsort(latency, latency_num, sizeof(long), latency_cmp);
+        double sum = 0;
+        for (long i = 0; i < latency_num; i++)
+            sum += latency[i];
+        printf("latency (us): avg %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+               sum / latency_num / 1000, percentile(latency, latency_num, 50),
+               percentile(latency, latency_num, 90), percentile(latency, latency_num, 99),
+               percentile(latency, latency_num, 99.9), latency[latency_num - 1] / 1000.0);
+        print_hist("latency histogram", "us", hist, HIST);
+    }
+
+    long sim_hist[DISK_STAT_HIST];
+    for (int i = 0; i < DISK_STAT_HIST; i++)
+        sim_hist[i] = st[0].latency[i];
+    printf("simulated: time %llu (seek %llu, rotation %llu, transfer %llu)\n",
+           (unsigned long long) st[0].time, (unsigned long long) st[0].seek_time,
+           (unsigned long long) st[0].rotation_time, (unsigned long long) st[0].transfer_time);
+    printf("simulated seeks: %llu over %llu cylinders, %.2f cylinders per request\n",
+           (unsigned long long) st[0].seeks, (unsigned long long) st[0].cylinders,
+           latency_num > 0 ? (double) st[0].cylinders / latency_num : 0.0);
+    if (latency_num > 0)
+        print_hist("simulated latency histogram", "", sim_hist, DISK_STAT_HIST);
+}
+
+void usage(const char *name) {
+    printf("Usage: %s [-p seq|stride|rand|zipf] [-m reads] [-b count] [-s stride] [-z theta]\n"
+           "       [-q depth] [-t seconds] [-n total] [-S seed] address\n", name);
+    exit(-1);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    // options:
+    //      -p <pattern>: seq, stride, rand or zipf
+    //      -m <reads>: % of reads, the rest are writes
+    //      -b <count>: blocks per request
+    //      -s <stride>: blocks between requests of stride
+    //      -z <theta>: exponent of zipf, the larger the more skewed
+    //      -q <depth>: requests in flight
+    //      -t <seconds>: duration
+    //      -n <total>: the most requests
+    //      -S <seed>: seed of the random numbers
+    while ((opt = getopt(argc, argv, "p:m:b:s:z:q:t:n:S:")) != -1) {
+        switch (opt) {
+            case 'p':
+                pattern = 0;
+                while (pattern <= PATTERN_ZIPF && strcmp(optarg, pattern_names[pattern]) != 0)
+                    pattern++;
+                if (pattern > PATTERN_ZIPF) {
+                    printf("Error: invalid pattern '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'm':
+                reads = atoi(optarg);
+                if (reads < 0 || reads > 100) {
+                    printf("Error: invalid reads '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'b':
+                count = atoi(optarg);
+                if (count < 1 || count > DISK_MAX_COUNT) {
+                    printf("Error: invalid count '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 's':
+                stride = atoi(optarg);
+                if (stride < 1) {
+                    printf("Error: invalid stride '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'z':
+                theta = atof(optarg);
+                if (theta <= 0) {
+                    printf("Error: invalid theta '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'q':
+                depth = atoi(optarg);
+                if (depth < 1 || depth > MAX_DEPTH) {
+                    printf("Error: invalid depth '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 't':
+                seconds = atof(optarg);
+                if (seconds <= 0) {
+                    printf("Error: invalid duration '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'n':
+                total = atol(optarg);
+                if (total < 1) {
+                    printf("Error: invalid total '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'S':
+                seed = strtoull(optarg, NULL, 10);
+                if (seed == 0)
+                    seed = 1;
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1)
+        usage(argv[0]);
+
+    disk_connect(argv[optind]);
+
+    // geometry of disk
+    __u32 org[2];
+    disk_send(DISK_OP_INFO, 0, 0, 0, NULL, 0);
+    read_reply(reply_data);
+    memcpy(org, reply_data, sizeof(org));
+    cylinders = org[0];
+    sectors_pc = org[1];
+    units = cylinders * sectors_pc / count;
+    if (units == 0) {
+        printf("Error: disk of %u x %u is smaller than %u blocks.\n", cylinders, sectors_pc, count);
+        exit(-1);
+    }
+    if (stride == 0)
+        stride = sectors_pc;
+    if (pattern == PATTERN_ZIPF)
+        init_zipf();
+
+    run();
+    disk_close();
+    return 0;
+}
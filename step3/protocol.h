@@ -0,0 +1,88 @@
+// Binary protocol between fs.c and disk.c.
+//
+// A request is a 'disk_request' followed by 'length' Bytes of payload.
+// disk.c answers every request with a 'disk_reply' followed by 'length'
+//      Bytes of payload, so no message needs to be parsed as text.
+// Many requests may be in flight, and their replies may come in another
+//      order, so a reply is matched to its request by 'id'.
+// Both processes run on the same host, so numbers are in host byte order.
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <asm/types.h>
+
+// opcode
+#define DISK_OP_INFO 'I'    // reply: cylinders and sectors per cylinder (2 x __u32)
+#define DISK_OP_READ 'R'    // reply: 'count' blocks from 'lba'
+#define DISK_OP_WRITE 'W'   // payload: 'count' blocks written from 'lba'
+#define DISK_OP_SET 'S'     // payload: 1 Byte, 'count' blocks from 'lba' are set to it
+#define DISK_OP_READV 'r'   // payload: 'count' LBAs (__u32), reply: their blocks
+#define DISK_OP_WRITEV 'w'  // payload: 'count' LBAs (__u32), then their blocks
+#define DISK_OP_EXIT 'E'    // the client leaves after the reply, disk.c exits with the last one
+#define DISK_OP_STAT 'T'    // reply: 'disk_stat' of the connection, then of the whole disk
+#define DISK_OP_FLUSH 'F'   // barrier: replied when the earlier writes are on storage
+#define DISK_OP_RING 'M'    // payload: name of shared-memory ring, which carries the
+                            //      later requests and replies, see ring.h
+
+// The maximum number of blocks of a request,
+//      and the maximum length of payload (blocks of 256 Bytes and LBAs).
+#define DISK_MAX_COUNT 256
+#define DISK_MAX_LEN (DISK_MAX_COUNT * (256 + 4))
+
+// status of reply
+#define DISK_OK 0
+#define DISK_ERR_RANGE 1    // blocks out of disk
+#define DISK_ERR_REQUEST 2  // unknown opcode or wrong payload length
+
+// disk_request
+// LBA of cylinder c and sector s: c * sectors_pc + s.
+// disk.c may serve queued requests, and the blocks of a request, out of
+//      order by its scheduling policy, but never moves a request ahead of
+//      an earlier one on the same blocks when either of them writes.
+// 'F' and 'E' are barriers: no request is moved across them.
+// Whether a reply of write means the write is on storage depends on the
+//      durability mode of disk.c; the reply of 'F' always means it.
+// 20 Bytes
+struct disk_request {
+    __u8 op;                // opcode
+    __u8 reserved[3];
+    __u32 id;               // request id, returned in reply
+    __u32 lba;              // first block
+    __u32 count;            // number of blocks
+    __u32 length;           // length of payload
+};
+
+// disk_reply
+// 16 Bytes
+struct disk_reply {
+    __u8 op;                // opcode of request
+    __u8 status;            // DISK_OK or DISK_ERR_*
+    __u8 reserved[2];
+    __u32 id;               // request id
+    __u32 length;           // length of payload
+    __u32 time;             // simulated time of the request, see 'disk_stat'
+};
+
+// disk_stat
+// Statistics of the simulated disk.
+// Times are in the unit of the track-to-track delay given to disk.c.
+// The time of a request is its seek time, rotational delay before each
+//      block, and transfer time of each block.
+#define DISK_STAT_OPS "IRWSrwETF"   // opcodes counted in 'ops', in order
+#define DISK_STAT_OP_NUM 9
+#define DISK_STAT_HIST 16
+// 248 Bytes
+struct disk_stat {
+    __u64 time;             // seek_time + rotation_time + transfer_time
+    __u64 seek_time;
+    __u64 rotation_time;
+    __u64 transfer_time;
+    __u64 seeks;            // moves of head
+    __u64 cylinders;        // cylinders travelled by head
+    __u64 ops[DISK_STAT_OP_NUM];    // requests by opcode
+    __u64 latency[DISK_STAT_HIST];  // requests by time from arrival to reply:
+                                    //      [0]: 0, [i]: 2^(i-1) ~ 2^i - 1,
+                                    //      and the last one for the longer
+};
+
+#endif
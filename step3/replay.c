@@ -0,0 +1,274 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <asm/types.h>
+#include "protocol.h"
+#include "disk_client.h"
+#include "trace.h"
+
+// Replay a trace of disk.c (see trace.h) to a disk server, and report
+//      its throughput, latency and simulated seek cost.
+// Requests are sent in order of arrival, through one connection:
+//      closed loop: as fast as disk.c replies, 'depth' requests in flight
+//      open loop:   at their times of arrival in the trace, scaled by
+//                   'speed', and at most 'depth' requests in flight
+// Reads, writes, sets and flushes are replayed, with the blocks of the
+//      trace. Written data is not in the trace, so a pattern is written.
+// Usage: ./replay [-o] [-q depth] [-x speed] trace_file address
+
+#define BLOCK_SIZE 256
+#define DEPTH 16            // default queue depth
+#define MAX_DEPTH 1024
+
+// replay_request
+struct replay_request {
+    __u8 op;
+    __u32 count;
+    __u32 *lba;             // 'count' LBAs
+    __u64 arrival;          // ns in trace
+};
+
+static struct replay_request *req;  // requests in order of arrival
+static int req_num;
+static struct trace_header header;
+static int depth = DEPTH;
+static int open_loop;               // 1 for open loop
+static double speed = 1;            // speed of open loop
+static __u64 *sent;                 // time of sending request i (ns)
+static long *latency;               // latencies in order of reply (ns)
+static char payload[DISK_MAX_LEN];       // payload of request
+static char reply_data[DISK_MAX_LEN];
+
+// Order requests by arrival, then by reply.
+int arrival_cmp(const void *a, const void *b) {
+    const struct replay_request *x = a, *y = b;
+    if (x->arrival != y->arrival)
+        return x->arrival < y->arrival ? -1 : 1;
+    return x < y ? -1 : 1;
+}
+
+// Read the requests of trace file 'name' which can be replayed.
+void load_trace(const char *name) {
+    FILE *f = fopen(name, "r");
+    if (f == NULL) {
+        printf("Error: Could not open file '%s'.\n", name);
+        exit(-1);
+    }
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != TRACE_MAGIC ||
+            header.version != TRACE_VERSION) {
+        printf("Error: '%s' is not a trace of disk.c.\n", name);
+        exit(-1);
+    }
+
+    int size = 0;
+    struct trace_record r;
+    struct trace_lbas l;
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        __u32 *lba = NULL;
+        int keep = r.status == DISK_OK && (r.op == DISK_OP_FLUSH ||
+                   (r.count >= 1 && r.count <= DISK_MAX_COUNT && strchr("RWSrw", r.op) != NULL));
+        if (keep) {
+            lba = (__u32 *) malloc((r.count + 1) * sizeof(__u32));
+            if (lba == NULL) {
+                printf("Error: Could not allocate trace.\n");
+                exit(-1);
+            }
+            for (__u32 i = 0; i <= r.count; i++)
+                lba[i] = r.lba + i;
+        }
+        for (__u32 i = 0; i < r.lbas; i++) {
+            if (fread(&l, sizeof(l), 1, f) != 1) {
+                printf("Error: trace '%s' is cut.\n", name);
+                exit(-1);
+            }
+            for (int j = 0; j < TRACE_LBAS; j++)
+                if (keep && 1 + i * TRACE_LBAS + j < r.count)
+                    lba[1 + i * TRACE_LBAS + j] = l.lba[j];
+        }
+        if (!keep)
+            continue;
+
+        if (req_num == size) {
+            size = size * 2 + 1024;
+            req = (struct replay_request *) realloc(req, size * sizeof(struct replay_request));
+            if (req == NULL) {
+                printf("Error: Could not allocate trace.\n");
+                exit(-1);
+            }
+        }
+        req[req_num].op = r.op;
+        req[req_num].count = r.count;
+        req[req_num].lba = lba;
+        req[req_num].arrival = r.arrival;
+        req_num++;
+    }
+    fclose(f);
+    qsort(req, req_num, sizeof(struct replay_request), arrival_cmp);
+}
+
+// Send request i, with id i + 1.
+void send_request(int i) {
+    struct replay_request *q = &req[i];
+    char *data = payload;
+    int length = 0;
+    switch (q->op) {
+        case DISK_OP_WRITE:
+            length = q->count * BLOCK_SIZE;
+            memset(data, 'a' + i % 26, length);
+            break;
+        case DISK_OP_SET:
+            data[0] = 'a' + i % 26;
+            length = 1;
+            break;
+        case DISK_OP_READV:
+            memcpy(data, q->lba, q->count * 4);
+            length = q->count * 4;
+            break;
+        case DISK_OP_WRITEV:
+            memcpy(data, q->lba, q->count * 4);
+            memset(data + q->count * 4, 'a' + i % 26, q->count * BLOCK_SIZE);
+            length = q->count * (4 + BLOCK_SIZE);
+            break;
+    }
+    sent[i] = now_ns();
+    disk_send(q->op, i + 1, q->lba[0], q->count, payload, length);
+}
+
+// Replay all the requests, and print the results.
+void replay() {
+    sent = (__u64 *) malloc((req_num + 1) * sizeof(__u64));
+    latency = (long *) malloc((req_num + 1) * sizeof(long));
+    if (sent == NULL || latency == NULL) {
+        printf("Error: Could not allocate trace.\n");
+        exit(-1);
+    }
+
+    int next = 0, done = 0, inflight = 0, errors = 0;
+    long blocks = 0;
+    __u64 start = now_ns();
+    __u64 first = req_num > 0 ? req[0].arrival : 0;
+    while (done < req_num) {
+        // send what is due, keeping at most 'depth' in flight,
+        //      then wait for a reply or the next one due
+        int wait = -1;
+        while (next < req_num && inflight < depth) {
+            if (open_loop) {
+                __u64 due = start + (__u64) ((req[next].arrival - first) / speed);
+                __u64 now = now_ns();
+                if (now < due) {
+                    wait = (due - now) / 1000000;
+                    break;
+                }
+            }
+            send_request(next++);
+            inflight++;
+        }
+
+        if (!disk_wait(wait))
+            continue;
+        struct disk_reply reply = read_reply(reply_data);
+        if (reply.id < 1 || reply.id > (__u32) req_num) {
+            printf("Error: wrong reply from disk.c.\n");
+            exit(-1);
+        }
+        int i = reply.id - 1;
+        latency[done++] = now_ns() - sent[i];
+        inflight--;
+        if (reply.status != DISK_OK)
+            errors++;
+        if (req[i].op != DISK_OP_FLUSH)
+            blocks += req[i].count;
+    }
+    double ms = (now_ns() - start) / 1e6;
+
+    // statistics of this connection from disk.c
+    struct disk_stat s[2];
+    bzero(s, sizeof(s));
+    disk_send(DISK_OP_STAT, 0, 0, 0, NULL, 0);
+    struct disk_reply reply = read_reply(reply_data);
+    if (reply.status == DISK_OK && reply.length == sizeof(s))
+        memcpy(s, reply_data, sizeof(s));
+    disk_send(DISK_OP_EXIT, 0, 0, 0, NULL, 0);
+    read_reply(reply_data);
+
+    printf("%d requests, %ld blocks in %.1f ms (%s loop, depth %d",
+           req_num, blocks, ms, open_loop ? "open" : "closed", depth);
+    if (open_loop)
+        printf(", speed %g", speed);
+    printf(")\n");
+    if (ms > 0)
+        printf("throughput: %.0f requests/s, %.2f MB/s\n",
+               req_num / ms * 1000, blocks * BLOCK_SIZE / ms / 1000);
+    if (req_num > 0) {
+        qsort(latency, req_num, sizeof(long), latency_cmp);
+        double sum = 0;
+        for (int i = 0; i < req_num; i++)
+            sum += latency[i];
+        printf("latency (us): avg %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+               sum / req_num / 1000, percentile(latency, req_num, 50),
+               percentile(latency, req_num, 90), percentile(latency, req_num, 99),
+               percentile(latency, req_num, 99.9), latency[req_num - 1] / 1000.0);
+    }
+    printf("errors: %d\n", errors);
+    printf("simulated: time %llu (seek %llu, rotation %llu, transfer %llu), "
+           "%llu seeks over %llu cylinders\n",
+           (unsigned long long) s[0].time, (unsigned long long) s[0].seek_time,
+           (unsigned long long) s[0].rotation_time, (unsigned long long) s[0].transfer_time,
+           (unsigned long long) s[0].seeks, (unsigned long long) s[0].cylinders);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    // options:
+    //      -o: open loop, at the times of the trace
+    //      -q <depth>: the most requests in flight
+    //      -x <speed>: speed of open loop, 2 for twice as fast as the trace
+    while ((opt = getopt(argc, argv, "oq:x:")) != -1) {
+        switch (opt) {
+            case 'o':
+                open_loop = 1;
+                break;
+            case 'q':
+                depth = atoi(optarg);
+                if (depth < 1 || depth > MAX_DEPTH) {
+                    printf("Error: invalid depth '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            case 'x':
+                speed = atof(optarg);
+                if (speed <= 0) {
+                    printf("Error: invalid speed '%s'.\n", optarg);
+                    exit(-1);
+                }
+                break;
+            default:
+                printf("Usage: %s [-o] [-q depth] [-x speed] trace_file address\n", argv[0]);
+                exit(-1);
+        }
+    }
+    if (argc - optind != 2) {
+        printf("Usage: %s [-o] [-q depth] [-x speed] trace_file address\n", argv[0]);
+        exit(-1);
+    }
+
+    load_trace(argv[optind]);
+    disk_connect(argv[optind + 1]);
+
+    // the trace must fit the disk
+    __u32 org[2];
+    disk_send(DISK_OP_INFO, 0, 0, 0, NULL, 0);
+    read_reply(reply_data);
+    memcpy(org, reply_data, sizeof(org));
+    if (org[0] * org[1] < header.cylinders * header.sectors_pc) {
+        printf("Error: disk of %u x %u is smaller than the trace of %u x %u.\n",
+               org[0], org[1], header.cylinders, header.sectors_pc);
+        exit(-1);
+    }
+
+    replay();
+    disk_close();
+    return 0;
+}
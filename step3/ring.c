@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "ring.h"
+
+// Map the segment of file id 'fd'.
+// Return: the segment mapped, or NULL on error.
+struct ring_shm *ring_map(int fd) {
+    void *p = mmap(NULL, sizeof(struct ring_shm), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    return p == MAP_FAILED ? NULL : (struct ring_shm *) p;
+}
+
+struct ring_shm *ring_create(const char *name) {
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, sizeof(struct ring_shm)) < 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    // a new segment is zero, so both rings are empty
+    struct ring_shm *shm = ring_map(fd);
+    if (shm == NULL)
+        shm_unlink(name);
+    else
+        shm->magic = RING_MAGIC;
+    return shm;
+}
+
+struct ring_shm *ring_attach(const char *name) {
+    if (strncmp(name, RING_NAME, strlen(RING_NAME)) != 0)
+        return NULL;
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size != sizeof(struct ring_shm)) {
+        close(fd);
+        return NULL;
+    }
+    struct ring_shm *shm = ring_map(fd);
+    if (shm != NULL && shm->magic != RING_MAGIC) {
+        ring_detach(shm);
+        return NULL;
+    }
+    return shm;
+}
+
+void ring_detach(struct ring_shm *shm) {
+    munmap(shm, sizeof(struct ring_shm));
+}
+
+// The other process reads 'head' and 'tail' while this one writes them,
+//      so they are accessed atomically: a slot is filled before 'tail'
+//      passes it, and consumed before 'head' passes it.
+
+struct ring_slot *ring_next(struct ring *r) {
+    __u32 tail = r->tail;   // only the producer writes it
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_SLOTS)
+        return NULL;
+    return &r->slot[tail % RING_SLOTS];
+}
+
+int ring_push(struct ring *r) {
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_SEQ_CST);
+    // pairs with 'ring_sleep': either the consumer sees the new slot,
+    //      or the producer sees it going to sleep
+    return __atomic_exchange_n(&r->waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+struct ring_slot *ring_peek(struct ring *r) {
+    __u32 head = r->head;   // only the consumer writes it
+    if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == head)
+        return NULL;
+    return &r->slot[head % RING_SLOTS];
+}
+
+void ring_pop(struct ring *r) {
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+int ring_sleep(struct ring *r) {
+    __atomic_store_n(&r->waiting, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == r->head;
+}
+
+void ring_awake(struct ring *r) {
+    __atomic_store_n(&r->waiting, 0, __ATOMIC_RELAXED);
+}
+
+// Return: monotonic time in us.
+long ring_now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+int ring_spin() {
+    static int spin = -1;
+    if (spin < 0)
+        spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPIN_US : 0;
+    return spin;
+}
+
+// A reply usually comes within a few us, sooner than a sleep and a wake.
+void ring_wait(struct ring *r, int ms) {
+    long start = ring_now_us();
+    while (ring_peek(r) == NULL) {
+        if (ring_now_us() - start < ring_spin())
+            continue;
+        if (ring_sleep(r)) {
+            // sleep while 'tail' is still 'head'
+            struct timespec ts = {ms / 1000, ms % 1000 * 1000000L};
+            syscall(SYS_futex, &r->tail, FUTEX_WAIT, r->head, &ts, NULL, 0);
+        }
+        ring_awake(r);
+        return;
+    }
+}
+
+void ring_wake(struct ring *r) {
+    syscall(SYS_futex, &r->tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
@@ -0,0 +1,79 @@
+// Shared-memory ring between fs.c and disk.c.
+//
+// Both processes run on the same host, so instead of sending each
+//      request and reply over a socket, fs.c may put them in a POSIX
+//      shared-memory segment: a submission ring of requests to disk.c
+//      and a completion ring of replies to fs.c. A slot holds a whole
+//      message, as it would be sent over the socket (see protocol.h).
+// fs.c creates the segment and names it to disk.c with DISK_OP_RING over
+//      the socket. After the reply, the socket carries no message:
+//      fs.c writes a Byte to it only to wake disk.c sleeping in epoll,
+//      and disk.c wakes fs.c by futex on the completion ring.
+// Each ring has one producer and one consumer, which never block each
+//      other. Every slot is free when a ring is created.
+#ifndef RING_H
+#define RING_H
+
+#include <asm/types.h>
+#include "protocol.h"
+
+#define RING_MAGIC 0x474e4952   // "RING"
+#define RING_NAME "/disk-ring-" // prefix of segment names
+#define RING_SLOTS 32           // slots of a ring, a power of 2
+#define RING_SLOT_SIZE (sizeof(struct disk_request) + DISK_MAX_LEN)
+#define RING_SPIN_US 50         // time to spin before sleeping for a slot, see 'ring_spin'
+
+// ring_slot
+struct ring_slot {
+    __u32 length;           // Bytes of message
+    char data[RING_SLOT_SIZE];
+};
+
+// ring
+// Slot i % RING_SLOTS is filled when head <= i < tail.
+struct ring {
+    __u32 head;             // the next slot to consume
+    __u32 tail;             // the next slot to produce
+    __u32 waiting;          // 1 if the consumer sleeps for a slot
+    struct ring_slot slot[RING_SLOTS];
+};
+
+// ring_shm
+// The shared-memory segment.
+struct ring_shm {
+    __u32 magic;
+    struct ring sq;         // submission: requests to disk.c
+    struct ring cq;         // completion: replies to fs.c
+};
+
+// Create segment 'name' of new rings.
+// Return: the segment mapped, or NULL on error.
+struct ring_shm *ring_create(const char *name);
+// Map segment 'name', created by 'ring_create'.
+// Return: the segment mapped, or NULL if it is not a ring.
+struct ring_shm *ring_attach(const char *name);
+void ring_detach(struct ring_shm *shm);
+
+// Producer: Return: the slot to fill, or NULL if ring is full.
+struct ring_slot *ring_next(struct ring *r);
+// Producer: pass the filled slot to the consumer.
+// Return: 1 if the consumer sleeps and must be woken.
+int ring_push(struct ring *r);
+// Consumer: Return: the oldest filled slot, or NULL if ring is empty.
+struct ring_slot *ring_peek(struct ring *r);
+// Consumer: free the oldest slot.
+void ring_pop(struct ring *r);
+// Consumer: tell the producer that the consumer is going to sleep.
+// Return: 1 if ring is still empty, so that it may sleep.
+int ring_sleep(struct ring *r);
+// Consumer: tell the producer that the consumer is awake again.
+void ring_awake(struct ring *r);
+// Return: us to spin before sleeping for a slot: RING_SPIN_US, or 0 on
+//      a single CPU, where spinning only keeps the producer from running.
+int ring_spin();
+// Consumer: wait at most 'ms' for a slot, by spinning, then by futex.
+void ring_wait(struct ring *r, int ms);
+// Producer: wake the consumer sleeping in 'ring_wait'.
+void ring_wake(struct ring *r);
+
+#endif
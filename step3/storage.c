@@ -0,0 +1,365 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include "storage.h"
+
+static int fd;              // file id of storage file
+static long file_size;      // size of storage file
+
+// Open storage file 'name' with 'flags'.
+void storage_open_file(const char *name, int flags) {
+    fd = open(name, flags);
+    if (fd < 0) {
+        printf("Error: Could not open file '%s'.\n", name);
+        exit(-1);
+    }
+}
+
+// Sync data of storage file.
+void storage_fdatasync() {
+    if (fdatasync(fd) < 0) {
+        printf("Error: Could not sync storage file.\n");
+        exit(-1);
+    }
+}
+
+// =================================================================
+// mmap: the whole file mapped with MAP_SHARED.
+
+static char *disk_file;     // pointer of memory map
+static long dirty_lo = -1;  // the first dirty Byte, -1 if clean
+static long dirty_hi;       // the end of dirty Bytes
+
+void mmap_open(const char *name, long size) {
+    storage_open_file(name, O_RDWR);
+    file_size = size;
+    disk_file = (char *) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (disk_file == MAP_FAILED) {
+        close(fd);
+        printf("Error: Could not map file.\n");
+        exit(-1);
+    }
+}
+
+void mmap_read(__u32 lba[], int n, char *data) {
+    for (int i = 0; i < n; i++)
+        memcpy(data + i * STORAGE_BLOCK_SIZE, &disk_file[(long) STORAGE_BLOCK_SIZE * lba[i]],
+               STORAGE_BLOCK_SIZE);
+}
+
+void mmap_write(__u32 lba[], int n, const char *data) {
+    for (int i = 0; i < n; i++) {
+        long loc = (long) STORAGE_BLOCK_SIZE * lba[i];
+        memcpy(&disk_file[loc], data + i * STORAGE_BLOCK_SIZE, STORAGE_BLOCK_SIZE);
+        if (dirty_lo < 0 || loc < dirty_lo)
+            dirty_lo = loc;
+        if (loc + STORAGE_BLOCK_SIZE > dirty_hi)
+            dirty_hi = loc + STORAGE_BLOCK_SIZE;
+    }
+}
+
+// Only the dirty pages are synced.
+// fdatasync would miss the writes made through the mapping.
+void mmap_sync() {
+    if (dirty_lo < 0)
+        return;
+    long page = sysconf(_SC_PAGESIZE);
+    long lo = dirty_lo / page * page;
+    if (msync(disk_file + lo, dirty_hi - lo, MS_SYNC) < 0) {
+        printf("Error: Could not sync storage file.\n");
+        exit(-1);
+    }
+    dirty_lo = -1;
+    dirty_hi = 0;
+}
+
+void mmap_close() {
+    munmap(disk_file, file_size);
+    close(fd);
+}
+
+// Blocks are sent to clients straight from the mapping.
+char *mmap_map(__u32 lba) {
+    return &disk_file[(long) STORAGE_BLOCK_SIZE * lba];
+}
+
+struct storage storage_mmap = {"mmap", mmap_open, mmap_read, mmap_write, mmap_sync, mmap_close,
+                               mmap_map};
+
+// =================================================================
+// pread: pread / pwrite, a run of contiguous blocks in one call.
+
+void pread_open(const char *name, long size) {
+    storage_open_file(name, O_RDWR);
+    file_size = size;
+}
+
+// Return: the number of blocks from 'lba[i]' which are contiguous.
+int storage_run(__u32 lba[], int n, int i) {
+    int j = i + 1;
+    while (j < n && lba[j] == lba[j - 1] + 1)
+        j++;
+    return j - i;
+}
+
+void pread_read(__u32 lba[], int n, char *data) {
+    for (int i = 0; i < n;) {
+        int run = storage_run(lba, n, i);
+        long done = 0, length = (long) run * STORAGE_BLOCK_SIZE;
+        while (done < length) {
+            long r = pread(fd, data + (long) i * STORAGE_BLOCK_SIZE + done, length - done,
+                           (long) STORAGE_BLOCK_SIZE * lba[i] + done);
+            if (r <= 0) {
+                printf("Error: Could not read storage file.\n");
+                exit(-1);
+            }
+            done += r;
+        }
+        i += run;
+    }
+}
+
+void pread_write(__u32 lba[], int n, const char *data) {
+    for (int i = 0; i < n;) {
+        int run = storage_run(lba, n, i);
+        long done = 0, length = (long) run * STORAGE_BLOCK_SIZE;
+        while (done < length) {
+            long r = pwrite(fd, data + (long) i * STORAGE_BLOCK_SIZE + done, length - done,
+                            (long) STORAGE_BLOCK_SIZE * lba[i] + done);
+            if (r <= 0) {
+                printf("Error: Could not write storage file.\n");
+                exit(-1);
+            }
+            done += r;
+        }
+        i += run;
+    }
+}
+
+void pread_close() {
+    close(fd);
+}
+
+struct storage storage_pread = {"pread", pread_open, pread_read, pread_write,
+                                storage_fdatasync, pread_close, NULL};
+
+// =================================================================
+// uring: io_uring on O_DIRECT.
+// O_DIRECT moves aligned pages only, so blocks are read and written in
+//      pages of URING_PAGE Bytes, and a page partly written is read first.
+// The pages are staged in buffers registered to the ring, if the kernel
+//      allows; otherwise plain reads and writes are used.
+
+#define URING_PAGE 4096
+#define URING_PAGE_BLOCKS (URING_PAGE / STORAGE_BLOCK_SIZE)
+#define URING_ENTRIES 256   // pages of a batch, and registered buffers
+
+static int ring_fd;
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_sqe *sqes;
+static struct io_uring_cqe *cqes;
+static void *sq_ring, *cq_ring;
+static long sq_ring_size, cq_ring_size;
+static char *pool;          // URING_ENTRIES pages
+static int pool_fixed;      // 1 if pool is registered
+
+void uring_open(const char *name, long size) {
+    // O_DIRECT reads whole pages, so the file ends at a page
+    struct stat st;
+    file_size = (size + URING_PAGE - 1) / URING_PAGE * URING_PAGE;
+    if (stat(name, &st) < 0 || (st.st_size < file_size && truncate(name, file_size) < 0)) {
+        printf("Error: Could not size file '%s'.\n", name);
+        exit(-1);
+    }
+    fd = open(name, O_RDWR | O_DIRECT);
+    if (fd < 0 && errno == EINVAL) {
+        printf("O_DIRECT is not supported on '%s', use page cache.\n", name);
+        fd = open(name, O_RDWR);
+    }
+    if (fd < 0) {
+        printf("Error: Could not open file '%s'.\n", name);
+        exit(-1);
+    }
+
+    // ring
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring_fd < 0) {
+        printf("Error: io_uring is not available.\n");
+        exit(-1);
+    }
+    sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_ring_size > sq_ring_size)
+            sq_ring_size = cq_ring_size;
+        cq_ring_size = sq_ring_size;
+    }
+    sq_ring = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   ring_fd, IORING_OFF_SQ_RING);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        cq_ring = sq_ring;
+    else
+        cq_ring = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_CQ_RING);
+    sqes = (struct io_uring_sqe *) mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                        ring_fd, IORING_OFF_SQES);
+    if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || sqes == MAP_FAILED) {
+        printf("Error: Could not map io_uring.\n");
+        exit(-1);
+    }
+    sq_head = (unsigned *) ((char *) sq_ring + p.sq_off.head);
+    sq_tail = (unsigned *) ((char *) sq_ring + p.sq_off.tail);
+    sq_mask = (unsigned *) ((char *) sq_ring + p.sq_off.ring_mask);
+    sq_array = (unsigned *) ((char *) sq_ring + p.sq_off.array);
+    cq_head = (unsigned *) ((char *) cq_ring + p.cq_off.head);
+    cq_tail = (unsigned *) ((char *) cq_ring + p.cq_off.tail);
+    cq_mask = (unsigned *) ((char *) cq_ring + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) ((char *) cq_ring + p.cq_off.cqes);
+
+    // buffers
+    if (posix_memalign((void **) &pool, URING_PAGE, (long) URING_ENTRIES * URING_PAGE) != 0) {
+        printf("Error: Could not allocate io_uring buffers.\n");
+        exit(-1);
+    }
+    struct iovec iov = {pool, (size_t) URING_ENTRIES * URING_PAGE};
+    pool_fixed = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    if (!pool_fixed)
+        printf("io_uring buffers are not registered, use plain reads and writes.\n");
+}
+
+// Queue a read or write of page 'page' with buffer 'slot' of pool.
+void uring_queue(int write, int slot, long page) {
+    unsigned tail = *sq_tail;
+    unsigned i = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    if (pool_fixed)
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    else
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long) (pool + (long) slot * URING_PAGE);
+    sqe->len = URING_PAGE;
+    sqe->off = page * URING_PAGE;
+    sqe->buf_index = 0;
+    sqe->user_data = slot;
+    sq_array[i] = i;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Submit the n queued operations and wait for all of them.
+void uring_submit(int n) {
+    int submitted = 0, done = 0;
+    while (done < n) {
+        int r = syscall(__NR_io_uring_enter, ring_fd, n - submitted, 1,
+                        IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0 && errno != EINTR) {
+            printf("Error: io_uring_enter failed.\n");
+            exit(-1);
+        }
+        if (r > 0)
+            submitted += r;
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            if (cqe->res != URING_PAGE) {
+                printf("Error: Could not access storage file (%d).\n", cqe->res);
+                exit(-1);
+            }
+            head++;
+            done++;
+        }
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    }
+}
+
+// Find the pages of the n blocks 'lba[i]' and put them in 'page'.
+// Block i is in page[slot[i]], and 'mask' tells the blocks of each page
+//      in the request.
+// Return: the number of pages.
+int uring_pages(__u32 lba[], int n, long page[], int slot[], __u32 mask[]) {
+    int num = 0;
+    for (int i = 0; i < n; i++) {
+        long pg = lba[i] / URING_PAGE_BLOCKS;
+        int k = 0;
+        while (k < num && page[k] != pg)
+            k++;
+        if (k == num) {
+            page[num] = pg;
+            mask[num++] = 0;
+        }
+        slot[i] = k;
+        mask[k] |= 1u << (lba[i] % URING_PAGE_BLOCKS);
+    }
+    return num;
+}
+
+void uring_read(__u32 lba[], int n, char *data) {
+    long page[URING_ENTRIES];
+    int slot[URING_ENTRIES];
+    __u32 mask[URING_ENTRIES];
+    int num = uring_pages(lba, n, page, slot, mask);
+    for (int k = 0; k < num; k++)
+        uring_queue(0, k, page[k]);
+    uring_submit(num);
+    for (int i = 0; i < n; i++)
+        memcpy(data + i * STORAGE_BLOCK_SIZE,
+               pool + (long) slot[i] * URING_PAGE + lba[i] % URING_PAGE_BLOCKS * STORAGE_BLOCK_SIZE,
+               STORAGE_BLOCK_SIZE);
+}
+
+void uring_write(__u32 lba[], int n, const char *data) {
+    long page[URING_ENTRIES];
+    int slot[URING_ENTRIES];
+    __u32 mask[URING_ENTRIES];
+    int num = uring_pages(lba, n, page, slot, mask);
+
+    // read the pages partly written
+    int reads = 0;
+    for (int k = 0; k < num; k++) {
+        if (mask[k] != (1u << URING_PAGE_BLOCKS) - 1) {
+            uring_queue(0, k, page[k]);
+            reads++;
+        }
+    }
+    uring_submit(reads);
+
+    for (int i = 0; i < n; i++)
+        memcpy(pool + (long) slot[i] * URING_PAGE + lba[i] % URING_PAGE_BLOCKS * STORAGE_BLOCK_SIZE,
+               data + i * STORAGE_BLOCK_SIZE, STORAGE_BLOCK_SIZE);
+    for (int k = 0; k < num; k++)
+        uring_queue(1, k, page[k]);
+    uring_submit(num);
+}
+
+void uring_close() {
+    close(ring_fd);
+    free(pool);
+    close(fd);
+}
+
+struct storage storage_uring = {"uring", uring_open, uring_read, uring_write,
+                                storage_fdatasync, uring_close, NULL};
+
+// =================================================================
+
+struct storage *storage_find(const char *name) {
+    static struct storage *all[] = {&storage_mmap, &storage_pread, &storage_uring};
+    for (int i = 0; i < (int) (sizeof(all) / sizeof(all[0])); i++)
+        if (strcmp(name, all[i]->name) == 0)
+            return all[i];
+    return NULL;
+}
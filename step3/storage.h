@@ -0,0 +1,41 @@
+// Block store of disk.c.
+//
+// The storage file holds the blocks of the simulated disk, block i at
+//      Byte i * STORAGE_BLOCK_SIZE. disk.c reaches it only through a
+//      'storage' backend, chosen at startup by name:
+//      mmap:  the whole file mapped with MAP_SHARED (the default)
+//      pread: pread / pwrite, contiguous blocks in one call
+//      uring: io_uring on O_DIRECT, with registered buffers
+// A backend reports errors and exits, as the rest of disk.c does.
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <asm/types.h>
+
+#define STORAGE_BLOCK_SIZE 256
+
+// storage
+// A backend of the block store.
+struct storage {
+    const char *name;
+    // open storage file 'name' of 'size' Bytes, which is already sized
+    void (*open)(const char *name, long size);
+    // read n blocks 'lba[i]' to 'data + i * STORAGE_BLOCK_SIZE'
+    void (*read)(__u32 lba[], int n, char *data);
+    // write n blocks 'lba[i]' from 'data + i * STORAGE_BLOCK_SIZE'
+    void (*write)(__u32 lba[], int n, const char *data);
+    // make the written blocks durable on storage
+    void (*sync)(void);
+    void (*close)(void);
+    // Return: address of block 'lba' in memory, valid until the next write,
+    //      or NULL if the backend keeps no blocks in memory (optional)
+    char *(*map)(__u32 lba);
+};
+
+// Return: the backend of 'name', or NULL if none.
+struct storage *storage_find(const char *name);
+
+// Names of all the backends, for usage.
+#define STORAGE_NAMES "mmap|pread|uring"
+
+#endif
@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "trace.h"
+
+#define TRACE_BATCH 256     // the most records written at a time, and the
+                            //      records which wake the thread
+
+static FILE *trace_file;
+static struct trace_record ring[TRACE_RING];   // or 'trace_lbas'
+static __u64 head;          // the next record to write, by the thread
+static __u64 tail;          // the next record to add, by disk.c
+static long dropped;        // records dropped by a full ring
+static int stopping;        // 1 when the thread should write the rest and stop
+static int waiting;         // 1 when the thread sleeps, a futex
+static pthread_t writer;
+static __u64 start;         // time of 'trace_open'
+
+// Return: monotonic time in ns.
+__u64 trace_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+__u64 trace_now() {
+    return trace_clock() - start;
+}
+
+// Thread: sleep until TRACE_BATCH records are waiting, or 'trace_close'.
+// Fewer records wait in memory, so an idle disk.c never wakes it.
+void trace_sleep() {
+    __atomic_store_n(&waiting, 1, __ATOMIC_SEQ_CST);
+    // pairs with 'trace_add' and 'trace_close': either the thread sees
+    //      the records or the stop, or they see it going to sleep
+    if (__atomic_load_n(&tail, __ATOMIC_SEQ_CST) - head < TRACE_BATCH &&
+            !__atomic_load_n(&stopping, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &waiting, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+    __atomic_store_n(&waiting, 0, __ATOMIC_RELAXED);
+}
+
+// Wake the thread sleeping in 'trace_sleep'.
+void trace_wake() {
+    if (__atomic_exchange_n(&waiting, 0, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &waiting, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Thread: write the records added, in batches, until 'trace_close'.
+void *trace_write(void *arg) {
+    (void) arg;
+    while (1) {
+        int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        __u64 t = __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+        if (t == head) {
+            if (stop)
+                break;
+            trace_sleep();
+            continue;
+        }
+        __u64 n = t - head;
+        if (n > TRACE_BATCH)
+            n = TRACE_BATCH;
+        // a batch does not wrap around the ring
+        if (head % TRACE_RING + n > TRACE_RING)
+            n = TRACE_RING - head % TRACE_RING;
+        if (fwrite(&ring[head % TRACE_RING], sizeof(struct trace_record), n, trace_file) != n) {
+            printf("Error: Could not write trace file.\n");
+            exit(-1);
+        }
+        __atomic_store_n(&head, head + n, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void trace_open(const char *name, struct trace_header *header) {
+    trace_file = fopen(name, "w");
+    if (trace_file == NULL) {
+        printf("Error: Could not open file '%s'.\n", name);
+        exit(-1);
+    }
+    if (fwrite(header, sizeof(*header), 1, trace_file) != 1) {
+        printf("Error: Could not write trace file.\n");
+        exit(-1);
+    }
+    start = trace_clock();
+    if (pthread_create(&writer, NULL, trace_write, NULL) != 0) {
+        printf("Error: Could not start trace thread.\n");
+        exit(-1);
+    }
+}
+
+void trace_add(struct trace_record *r, struct trace_lbas *lbas) {
+    if (trace_file == NULL)
+        return;
+    if (tail + 1 + r->lbas - __atomic_load_n(&head, __ATOMIC_ACQUIRE) > TRACE_RING) {
+        dropped++;
+        return;
+    }
+    ring[tail % TRACE_RING] = *r;
+    for (__u32 i = 0; i < r->lbas; i++)
+        memcpy(&ring[(tail + 1 + i) % TRACE_RING], &lbas[i], sizeof(struct trace_record));
+    __atomic_store_n(&tail, tail + 1 + r->lbas, __ATOMIC_SEQ_CST);
+    if (tail - __atomic_load_n(&head, __ATOMIC_ACQUIRE) >= TRACE_BATCH &&
+            __atomic_load_n(&waiting, __ATOMIC_SEQ_CST))
+        trace_wake();
+}
+
+long trace_close() {
+    if (trace_file == NULL)
+        return 0;
+    __atomic_store_n(&stopping, 1, __ATOMIC_SEQ_CST);
+    trace_wake();
+    pthread_join(writer, NULL);
+    fclose(trace_file);
+    trace_file = NULL;
+    return dropped;
+}
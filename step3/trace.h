@@ -0,0 +1,75 @@
+// Binary trace of disk.c.
+//
+// disk.c records every request it replies in a compact record, instead
+//      of (or besides) the text on stdout and in disk.log. Records go to
+//      a ring in memory without a lock, and a thread writes them to the
+//      trace file, woken by futex only once a batch of them is waiting
+//      (the rest by 'trace_close'). If the thread falls behind and the
+//      ring is full, records are dropped and counted, so serving requests
+//      never waits for the trace.
+// The file is a 'trace_header' followed by 'trace_record's, in order of
+//      reply. trace_dump prints it as text, and replay sends its requests
+//      to disk.c again.
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <asm/types.h>
+
+#define TRACE_MAGIC 0x43525444  // "DTRC"
+#define TRACE_VERSION 2
+#define TRACE_RING 4096         // records in memory, a power of 2
+
+// trace_header
+// 32 Bytes
+struct trace_header {
+    __u32 magic;
+    __u32 version;
+    __u32 cylinders;
+    __u32 sectors_pc;       // sectors per cylinder
+    __u32 move_delay;       // track-to-track delay
+    __u32 sector_time;      // see SECTOR_TIME of disk.c
+    __u32 policy;           // scheduling policy
+    __u32 reserved;
+};
+
+// trace_record
+// Times are ns since the trace is opened, and simulated times are in
+//      the unit of track-to-track delay (see 'disk_stat' in protocol.h).
+// 48 Bytes
+struct trace_record {
+    __u64 arrival;          // time of arrival in queue
+    __u64 time;             // time of reply
+    __u8 op;                // opcode, see protocol.h
+    __u8 status;            // status of reply
+    __u8 conn;              // connection of client, 255 for stdin
+    __u8 reserved;
+    __u32 id;               // request id
+    __u32 lba;              // the first block of request, 0 if none
+    __u32 count;            // number of blocks
+    __u32 cylinders;        // cylinders travelled by head for it
+    __u32 sim_time;         // simulated time of request
+    __u32 latency;          // simulated time from arrival to reply
+    __u32 lbas;             // 'trace_lbas' records following it
+};
+
+// trace_lbas
+// The LBAs of 'r' and 'w' after the first, in order of request, in the
+//      records following theirs. The last one is padded with zeros.
+#define TRACE_LBAS 12
+// 48 Bytes
+struct trace_lbas {
+    __u32 lba[TRACE_LBAS];
+};
+
+// Open trace file 'name' with 'header', and start the thread writing it.
+void trace_open(const char *name, struct trace_header *header);
+// Return: ns since the trace is opened.
+__u64 trace_now();
+// Add record 'r' and 'r->lbas' records of LBAs in 'lbas', or drop them
+//      all if the ring is full.
+void trace_add(struct trace_record *r, struct trace_lbas *lbas);
+// Write the records left, and close the trace file.
+// Return: the number of records dropped.
+long trace_close();
+
+#endif
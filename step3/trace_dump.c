@@ -0,0 +1,56 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <asm/types.h>
+#include "trace.h"
+
+// Print a binary trace of disk.c (see trace.h) as text.
+// A line per request: time of reply and wait since arrival (us),
+//      connection, id, opcode, cylinder and sector of the first block,
+//      blocks, status, cylinders travelled, simulated time and latency.
+
+int main(int argc, char *argv[]) {
+    if (argc != 2) {
+        printf("Usage: %s trace_file\n", argv[0]);
+        exit(-1);
+    }
+    FILE *f = fopen(argv[1], "r");
+    if (f == NULL) {
+        printf("Error: Could not open file '%s'.\n", argv[1]);
+        exit(-1);
+    }
+
+    struct trace_header h;
+    if (fread(&h, sizeof(h), 1, f) != 1 || h.magic != TRACE_MAGIC || h.version != TRACE_VERSION) {
+        printf("Error: '%s' is not a trace of disk.c.\n", argv[1]);
+        exit(-1);
+    }
+    printf("# %u cylinders, %u sectors per cylinder, delay %u, sector time %u, policy %u\n",
+           h.cylinders, h.sectors_pc, h.move_delay, h.sector_time, h.policy);
+    printf("# %12s %10s %4s %10s %2s %6s %6s %5s %3s %6s %8s %8s\n", "time", "wait", "conn", "id",
+           "op", "cyl", "sec", "count", "st", "seek", "sim", "latency");
+
+    struct trace_record r;
+    struct trace_lbas l;
+    long n = 0;
+    unsigned long long cylinders = 0, sim_time = 0;
+    while (fread(&r, sizeof(r), 1, f) == 1) {
+        // the LBAs of 'r' and 'w' are not printed
+        for (__u32 i = 0; i < r.lbas; i++)
+            if (fread(&l, sizeof(l), 1, f) != 1) {
+                printf("Error: trace '%s' is cut.\n", argv[1]);
+                exit(-1);
+            }
+        __u32 spc = h.sectors_pc > 0 ? h.sectors_pc : 1;
+        printf("%14.3f %10.3f %4u %10u %2c %6u %6u %5u %3u %6u %8u %8u\n",
+               r.time / 1000.0, (r.time - r.arrival) / 1000.0, r.conn, r.id,
+               r.op, r.lba / spc, r.lba % spc, r.count, r.status, r.cylinders,
+               r.sim_time, r.latency);
+        n++;
+        cylinders += r.cylinders;
+        sim_time += r.sim_time;
+    }
+    printf("# %ld requests, %llu cylinders travelled, simulated time %llu\n", n, cylinders, sim_time);
+    fclose(f);
+    return 0;
+}
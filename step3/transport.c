@@ -0,0 +1,151 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include "transport.h"
+
+// Address of a socket, of any transport.
+struct transport_addr {
+    int family;             // AF_INET or AF_UNIX
+    socklen_t length;
+    union {
+        struct sockaddr sa;
+        struct sockaddr_in in;
+        struct sockaddr_un un;
+    };
+};
+
+// Parse 'address' to 'addr'.
+// A TCP address without host is 'any' to listen, or localhost to connect.
+void transport_parse(const char *address, int listening, struct transport_addr *addr) {
+    bzero(addr, sizeof(*addr));
+
+    // Unix-domain
+    if (strncmp(address, TRANSPORT_UNIX, strlen(TRANSPORT_UNIX)) == 0) {
+        const char *path = address + strlen(TRANSPORT_UNIX);
+        if (path[0] == '\0' || strlen(path) >= sizeof(addr->un.sun_path)) {
+            printf("Error: invalid socket path '%s'.\n", path);
+            exit(-1);
+        }
+        addr->family = AF_UNIX;
+        addr->length = sizeof(addr->un);
+        addr->un.sun_family = AF_UNIX;
+        strcpy(addr->un.sun_path, path);
+        return;
+    }
+
+    // TCP
+    char host_name[256] = "localhost";  // localhost
+    const char *port = strrchr(address, ':');
+    if (port != NULL) {
+        if (port - address >= (long) sizeof(host_name)) {
+            printf("Error: invalid address '%s'.\n", address);
+            exit(-1);
+        }
+        memcpy(host_name, address, port - address);
+        host_name[port - address] = '\0';
+        port++;
+    } else {
+        port = address;
+    }
+    int portno = atoi(port);
+    if (portno <= 0 || portno > 65535) {
+        printf("Error: invalid port '%s'.\n", port);
+        exit(-1);
+    }
+    addr->family = AF_INET;
+    addr->length = sizeof(addr->in);
+    addr->in.sin_family = AF_INET;      // IPv4 address
+    addr->in.sin_port = htons(portno);
+    // htons() converts the port number from host byte order to network byte order
+    if (listening && port == address) {
+        addr->in.sin_addr.s_addr = INADDR_ANY;  // bind the socket
+        return;
+    }
+    struct hostent *server = gethostbyname(host_name);
+    if (server == NULL) {
+        printf("Error: no such host.\n");
+        exit(-1);
+    }
+    bcopy((char *) server->h_addr,
+          (char *) &addr->in.sin_addr.s_addr,
+          server->h_length);
+}
+
+// Send the small writes of 'sockfd' at once, if it is TCP.
+// Requests are pipelined: without this, Nagle's algorithm holds a small
+//      request back until the earlier ones are acknowledged, and the
+//      delayed ACK of the peer stalls it for about 40 ms.
+// It fails harmlessly on a Unix-domain socket.
+void transport_nodelay(int sockfd) {
+    int one = 1;
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+int transport_listen(const char *address) {
+    struct transport_addr addr;
+    transport_parse(address, 1, &addr);
+
+    // create socket
+    int sockfd = socket(addr.family, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        printf("Error: opening socket.\n");
+        exit(-1);
+    }
+    if (addr.family == AF_UNIX)
+        unlink(addr.un.sun_path);
+
+    // bind
+    if (bind(sockfd, &addr.sa, addr.length) < 0) {
+        printf("Error: on binding.\n");
+        exit(-1);
+    }
+
+    // listen
+    if (listen(sockfd, 5) == -1) {
+        printf("Error: on listening.\n");
+        close(sockfd);
+        exit(-1);
+    }
+    return sockfd;
+}
+
+int transport_accept(int sockfd) {
+    // the address of peer is not used
+    int newsockfd = accept(sockfd, NULL, NULL);
+    if (newsockfd >= 0)
+        transport_nodelay(newsockfd);
+    return newsockfd;
+}
+
+int transport_connect(const char *address) {
+    struct transport_addr addr;
+    transport_parse(address, 0, &addr);
+
+    int sockfd = socket(addr.family, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        printf("Error: opening socket.\n");
+        exit(-1);
+    }
+
+    // connect
+    if (connect(sockfd, &addr.sa, addr.length) < 0) {
+        printf("Error: connecting.\n");
+        exit(-1);
+    }
+    if (addr.family == AF_INET)
+        transport_nodelay(sockfd);
+    return sockfd;
+}
+
+void transport_close(int sockfd, const char *address) {
+    close(sockfd);
+    if (strncmp(address, TRANSPORT_UNIX, strlen(TRANSPORT_UNIX)) == 0)
+        unlink(address + strlen(TRANSPORT_UNIX));
+}
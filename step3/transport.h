@@ -0,0 +1,26 @@
+// Transport between client.c, fs.c and disk.c.
+//
+// A process listens on, or connects to, an address given on the command
+//      line, and its syntax chooses the transport:
+//      <port>          TCP on localhost (a listener takes any interface)
+//      <host>:<port>   TCP on <host>
+//      unix:<path>     Unix-domain stream socket at <path>
+// Either way a connection is a stream socket, read and written as usual.
+// Errors are reported and exit, as the rest of the processes do.
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#define TRANSPORT_UNIX "unix:"
+
+// Return: socket listening on 'address'.
+// A stale socket file of a Unix-domain address is replaced.
+int transport_listen(const char *address);
+// Return: a connection accepted from listening socket 'sockfd',
+//      or -1 if none (when 'sockfd' does not block).
+int transport_accept(int sockfd);
+// Return: socket connected to 'address'.
+int transport_connect(const char *address);
+// Close listening socket 'sockfd' of 'address', and remove its socket file.
+void transport_close(int sockfd, const char *address);
+
+#endif